@@ -2,4 +2,4 @@
 
 set -xe
 
-g++ eval.cpp -Ofast -o ex -llightning
+g++ eval.cpp -Ofast -pthread -o ex -llightning
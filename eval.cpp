@@ -1,371 +1,7118 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cmath>
+#include <csetjmp>
+#include <csignal>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 extern "C" {
 #include <lightning.h>
 }
 
 using namespace std;
 
+// Interns identifiers to dense integer ids so that the parser and code
+// generator compare ints instead of strings. Open addressing with linear
+// probing over a power-of-two table; one table is shared by every
+// expression in the process. Names already interned only take a shared
+// lock, so parser threads do not serialise on the common case.
+class SymbolTable {
+public:
+  int intern(string_view name) {
+    uint32_t h = hash(name);
+    {
+      shared_lock<shared_mutex> lock(mu);
+      if (int id = slots[probe(name, h)]; id >= 0)
+        return id;
+    }
+    unique_lock<shared_mutex> lock(mu);
+    size_t slot = probe(name, h);
+    if (slots[slot] >= 0)
+      return slots[slot];
+
+    int id = names.size();
+    names.emplace_back(name);
+    hashes.push_back(h);
+    slots[slot] = id;
+    if (names.size() * 2 > slots.size())
+      grow();
+    return id;
+  }
+
+  // -1 when the name has never been interned
+  int find(string_view name) const {
+    shared_lock<shared_mutex> lock(mu);
+    return slots[probe(name, hash(name))];
+  }
+
+  const string &name(int id) const {
+    shared_lock<shared_mutex> lock(mu);
+    return names[id];
+  }
+
+  size_t size() const {
+    shared_lock<shared_mutex> lock(mu);
+    return names.size();
+  }
+
+private:
+  static uint32_t hash(string_view name) {
+    uint32_t h = 2166136261u;
+    for (unsigned char c : name)
+      h = (h ^ c) * 16777619u;
+    return h;
+  }
+
+  size_t probe(string_view name, uint32_t h) const {
+    size_t mask = slots.size() - 1;
+    for (size_t slot = h & mask;; slot = (slot + 1) & mask) {
+      int id = slots[slot];
+      if (id < 0 || (hashes[id] == h && names[id] == name))
+        return slot;
+    }
+  }
+
+  void grow() {
+    vector<int> old(slots.size() * 2, -1);
+    swap(old, slots);
+    size_t mask = slots.size() - 1;
+    for (int id = 0; id < (int)names.size(); ++id) {
+      size_t slot = hashes[id] & mask;
+      while (slots[slot] >= 0)
+        slot = (slot + 1) & mask;
+      slots[slot] = id;
+    }
+  }
+
+  vector<int> slots = vector<int>(64, -1);
+  deque<string> names;
+  vector<uint32_t> hashes;
+  mutable shared_mutex mu;
+};
+
+static SymbolTable symbols;
+
+bool is_identifier(string_view name) {
+  return !name.empty() && (isalpha(name[0]) || name[0] == '_');
+}
+
+bool is_number(string_view name) {
+  return !name.empty() && all_of(name.begin(), name.end(), ::isdigit);
+}
+
+// an imaginary literal such as 3i
+bool is_imaginary(string_view name) {
+  return name.size() > 1 && name.back() == 'i' &&
+         is_number(name.substr(0, name.size() - 1));
+}
+
+// The rpn word for an operator applied to arity operands. Unary minus
+// gets its own word so it is never compiled as a subtraction, and unary
+// plus none at all.
+string_view rpn_word(string_view op, size_t arity) {
+  if (arity == 1 && op == "-")
+    return "--";
+  if (arity == 1 && op == "+")
+    return "";
+  return op;
+}
+
 struct S {
   string head;
   vector<shared_ptr<S>> rest;
+  int sym = -1; // interned id when head is a variable or function name
 
   S(string h) : head(std::move(h)) {}
+  S(string h, int sym) : head(std::move(h)), sym(sym) {}
   S(string h, vector<shared_ptr<S>> r)
-      : head(std::move(h)), rest(std::move(r)) {}
+      : head(std::move(h)), rest(std::move(r)) {
+    if (is_identifier(head))
+      sym = symbols.intern(head);
+  }
 
   string to_string() const {
     ostringstream oss;
-    for (const auto &s : rest) {
-      oss << s->to_string() << ' ';
+    for (size_t i = 0; i < rest.size(); ++i) {
+      if (i)
+        oss << ' ';
+      oss << rest[i]->to_string();
     }
-    oss << head;
+    // an empty head is a bare sequence such as "456 789"
+    string_view word = rpn_word(head, rest.size());
+    if (!word.empty())
+      oss << (rest.empty() ? "" : " ") << word;
     return oss.str();
   }
 };
 
 enum class TokenType { Atom, Op, Eof };
 
+// value points into the lexer's input, which must outlive the token
 struct Token {
   TokenType type;
-  string value;
+  string_view value;
+  int sym;
 
-  Token(TokenType t, string v = "") : type(t), value(std::move(v)) {}
+  Token(TokenType t, string_view v = "", int sym = -1)
+      : type(t), value(v), sym(sym) {}
 };
 
 class Lexer {
 public:
-  explicit Lexer(const string &input) {
-    size_t i = 0;
-    while (i < input.size()) {
-      if (isspace(input[i])) {
-        ++i;
-        continue;
-      }
+  explicit Lexer(string_view input) : input(input), lookahead(scan()) {}
 
-      if (isdigit(input[i])) {
-        size_t start = i;
-        while (i < input.size() && isdigit(input[i]))
-          ++i;
-        tokens.emplace_back(TokenType::Atom, input.substr(start, i - start));
-        continue;
-      }
+  Token next() {
+    Token token = std::move(lookahead);
+    lookahead = scan();
+    return token;
+  }
 
-      if (isalnum(input[i])) {
-        tokens.emplace_back(TokenType::Atom, string(1, input[i]));
-        ++i;
-        continue;
-      }
+  const Token &peek() const { return lookahead; }
 
-      tokens.emplace_back(TokenType::Op, string(1, input[i]));
+private:
+  // tokens are scanned on demand, one ahead of the parser
+  Token scan() {
+    while (i < input.size() && isspace(input[i]))
       ++i;
+    if (i == input.size())
+      return {TokenType::Eof};
+
+    if (isdigit(input[i])) {
+      size_t start = i;
+      while (i < input.size() && isdigit(input[i]))
+        ++i;
+      if (i < input.size() && input[i] == 'i' &&
+          (i + 1 == input.size() ||
+           !(isalnum(input[i + 1]) || input[i + 1] == '_')))
+        ++i;
+      return {TokenType::Atom, input.substr(start, i - start)};
     }
-    tokens.emplace_back(TokenType::Eof);
-    reverse(tokens.begin(), tokens.end());
-  }
 
-  Token next() {
-    if (tokens.empty())
-      return {TokenType::Eof};
-    Token token = tokens.back();
-    tokens.pop_back();
-    return token;
-  }
+    if (isalpha(input[i]) || input[i] == '_') {
+      size_t start = i;
+      while (i < input.size() && (isalnum(input[i]) || input[i] == '_'))
+        ++i;
+      string_view name = input.substr(start, i - start);
+      return {TokenType::Atom, name, symbols.intern(name)};
+    }
 
-  Token peek() const {
-    if (tokens.empty())
-      return {TokenType::Eof};
-    return tokens.back();
+    // the shifts are the only operators longer than one character
+    for (string_view op : {">>>", ">>", "<<"})
+      if (input.substr(i, op.size()) == op) {
+        i += op.size();
+        return {TokenType::Op, input.substr(i - op.size(), op.size())};
+      }
+
+    return {TokenType::Op, input.substr(i++, 1)};
   }
 
-private:
-  vector<Token> tokens;
+  string_view input;
+  size_t i = 0;
+  Token lookahead;
 };
 
-shared_ptr<S> expr_bp(Lexer &lexer, int min_bp);
+// The parser hands every node it recognises to a builder, children first,
+// so the same grammar can produce S trees or fill a flat arena:
+//
+//   Ref leaf(const Token &atom)
+//   Ref apply(string_view head, const Ref *rest, size_t n)
+template <typename B>
+typename B::Ref expr_bp(Lexer &lexer, int min_bp, B &builder);
+
+template <typename B> typename B::Ref parse(Lexer &lexer, B &builder) {
+  auto lhs = expr_bp(lexer, 0, builder);
+  if (lexer.peek().type == TokenType::Eof)
+    return lhs;
+
+  vector<typename B::Ref> seq{lhs};
+  while (lexer.peek().type != TokenType::Eof)
+    seq.push_back(expr_bp(lexer, 0, builder));
+  return builder.apply("", seq.data(), seq.size());
+}
+
+struct TreeBuilder {
+  typedef shared_ptr<S> Ref;
+
+  Ref leaf(const Token &atom) {
+    return make_shared<S>(string(atom.value), atom.sym);
+  }
+
+  Ref apply(string_view head, const Ref *rest, size_t n) {
+    return make_shared<S>(string(head), vector<Ref>(rest, rest + n));
+  }
+};
 
 shared_ptr<S> expr(const string &input) {
   Lexer lexer(input);
-  return expr_bp(lexer, 0);
+  TreeBuilder builder;
+  return parse(lexer, builder);
 }
 
-pair<int, int> infix_binding_power(char op) {
-  switch (op) {
+pair<int, int> infix_binding_power(string_view op) {
+  if (op == "<<" || op == ">>" || op == ">>>")
+    return {11, 12};
+  if (op.size() != 1)
+    return {-1, -1};
+  switch (op[0]) {
   case '=':
     return {2, 1};
   case '?':
     return {4, 3};
+  case '|':
+    return {5, 6};
+  case '^':
+    return {7, 8};
+  case '&':
+    return {9, 10};
   case '+':
   case '-':
-    return {5, 6};
+    return {13, 14};
   case '*':
   case '/':
-    return {7, 8};
+    return {15, 16};
   case '.':
-    return {14, 13};
+    return {22, 21};
   default:
     return {-1, -1};
   }
 }
 
-int prefix_binding_power(char op) {
-  switch (op) {
+int prefix_binding_power(string_view op) {
+  if (op.size() != 1)
+    return -1;
+  switch (op[0]) {
   case '+':
   case '-':
-    return 9;
-  case '(':
-    return 15;
+  case '~':
+    return 17;
   default:
     return -1;
   }
 }
 
-int postfix_binding_power(char op) {
-  switch (op) {
+int postfix_binding_power(string_view op) {
+  if (op.size() != 1)
+    return -1;
+  switch (op[0]) {
   case '!':
   case '[':
-    return 11;
-  case ')':
-    return 12;
+    return 19;
   default:
     return -1;
   }
 }
 
-shared_ptr<S> expr_bp(Lexer &lexer, int min_bp) {
+template <typename B>
+typename B::Ref expr_bp(Lexer &lexer, int min_bp, B &builder) {
   Token token = lexer.next();
-  shared_ptr<S> lhs;
+  typename B::Ref lhs;
 
-  if (token.type == TokenType::Atom) {
-    lhs = make_shared<S>(token.value);
+  if (token.type == TokenType::Atom && token.sym >= 0 &&
+      lexer.peek().value == "(") {
+    // function call: name(arg, ...)
+    lexer.next();
+    vector<typename B::Ref> args;
+    if (lexer.peek().value != ")") {
+      args.push_back(expr_bp(lexer, 0, builder));
+      while (lexer.peek().value == ",") {
+        lexer.next();
+        args.push_back(expr_bp(lexer, 0, builder));
+      }
+    }
+    if (lexer.next().value != ")")
+      throw runtime_error("Expected ')'");
+    lhs = builder.apply(token.value, args.data(), args.size());
+  } else if (token.type == TokenType::Atom) {
+    lhs = builder.leaf(token);
   } else if (token.type == TokenType::Op && token.value == "(") {
-    lhs = expr_bp(lexer, 0);
+    lhs = expr_bp(lexer, 0, builder);
+    if (lexer.next().value != ")")
+      throw runtime_error("Expected ')'");
+  } else if (token.type == TokenType::Op && token.value == "[") {
+    // list literal [a, b, ...], the tables of bucket() and piecewise()
+    vector<typename B::Ref> items;
+    if (lexer.peek().value != "]") {
+      items.push_back(expr_bp(lexer, 0, builder));
+      while (lexer.peek().value == ",") {
+        lexer.next();
+        items.push_back(expr_bp(lexer, 0, builder));
+      }
+    }
+    if (lexer.next().value != "]")
+      throw runtime_error("Expected ']'");
+    lhs = builder.apply(token.value, items.data(), items.size());
   } else if (token.type == TokenType::Op) {
-    int r_bp = prefix_binding_power(token.value[0]);
-    auto rhs = expr_bp(lexer, r_bp);
-    lhs = make_shared<S>(token.value, vector<shared_ptr<S>>{rhs});
+    int r_bp = prefix_binding_power(token.value);
+    if (r_bp < 0)
+      throw runtime_error("Unexpected token");
+    auto rhs = expr_bp(lexer, r_bp, builder);
+    lhs = builder.apply(token.value, &rhs, 1);
   } else {
     throw runtime_error("Unexpected token");
   }
 
   while (true) {
-    Token lookahead = lexer.peek();
-    if (lookahead.type == TokenType::Eof)
+    // lookahead refers into the lexer, so it is dead after lexer.next()
+    const Token &lookahead = lexer.peek();
+    if (lookahead.type != TokenType::Op)
       break;
 
-    if (lookahead.type == TokenType::Op) {
-      if (int l_bp = postfix_binding_power(lookahead.value[0]);
-          l_bp >= min_bp) {
-        lexer.next();
-        lhs = make_shared<S>(lookahead.value, vector<shared_ptr<S>>{lhs});
+    if (int l_bp = postfix_binding_power(lookahead.value); l_bp >= min_bp) {
+      Token op = lexer.next();
+      if (op.value == "[") {
+        // index: a[i] is element i of column a
+        typename B::Ref rest[] = {lhs, expr_bp(lexer, 0, builder)};
+        if (lexer.next().value != "]")
+          throw runtime_error("Expected ']'");
+        lhs = builder.apply("[]", rest, 2);
         continue;
       }
+      lhs = builder.apply(op.value, &lhs, 1);
+      continue;
+    }
 
-      auto [l_bp, r_bp] = infix_binding_power(lookahead.value[0]);
-      if (l_bp < min_bp)
-        break;
+    auto [l_bp, r_bp] = infix_binding_power(lookahead.value);
+    if (l_bp < min_bp)
+      break;
 
-      lexer.next();
+    Token op = lexer.next();
 
-      if (lookahead.value[0] == '?') {
-        auto mhs = expr_bp(lexer, 0);
-        auto rhs = expr_bp(lexer, r_bp);
-        lhs = make_shared<S>(lookahead.value,
-                             vector<shared_ptr<S>>{lhs, mhs, rhs});
-      } else {
-        auto rhs = expr_bp(lexer, r_bp);
-        lhs = make_shared<S>(lookahead.value, vector<shared_ptr<S>>{lhs, rhs});
-      }
+    if (op.value[0] == '?') {
+      auto mhs = expr_bp(lexer, 0, builder);
+      if (lexer.next().value != ":")
+        throw runtime_error("Expected ':'");
+      auto rhs = expr_bp(lexer, r_bp, builder);
+      typename B::Ref rest[] = {lhs, mhs, rhs};
+      lhs = builder.apply(op.value, rest, 3);
+    } else {
+      auto rhs = expr_bp(lexer, r_bp, builder);
+      typename B::Ref rest[] = {lhs, rhs};
+      lhs = builder.apply(op.value, rest, 2);
     }
   }
 
   return lhs;
 }
 
-typedef int (*pifi)(int);
-typedef int (*pifv)(void);
-
-static jit_state_t *_jit;
+// Compact binary form of parsed expressions so stored rule sets load
+// without lexing or precedence parsing:
+//
+//   "JXB1" varint(#symbols) {varint(len) bytes}* varint(#exprs)
+//   {varint(#bytes) postfix code}*
+//
+// Postfix code is a stream of opcodes: BIN_CONST varint(zigzag value),
+// BIN_SYMBOL varint(symbol), BIN_APPLY varint(head symbol) varint(arity), an
+// ASCII operator character for binary operators ('?' takes three operands),
+// or the character | 0x80 for prefix and postfix operators.
+enum BinOp : uint8_t { BIN_CONST, BIN_SYMBOL, BIN_APPLY };
 
-void stack_push(int reg, int *sp) {
-  jit_stxi_i(*sp, JIT_FP, reg);
-  *sp += sizeof(int);
+void put_varint(string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out += char(v | 0x80);
+    v >>= 7;
+  }
+  out += char(v);
 }
 
-void stack_pop(int reg, int *sp) {
-  *sp -= sizeof(int);
-  jit_ldxi_i(reg, JIT_FP, *sp);
+uint64_t get_varint(const uint8_t *&p, const uint8_t *end) {
+  uint64_t v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t byte = *p++;
+    v |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return v;
+  }
+  throw runtime_error("truncated varint");
 }
 
-jit_node_t *compile_rpn(const char *expr) {
-  jit_node_t *in, *fn;
-  int stack_base, stack_ptr;
-
-  fn = jit_note(NULL, 0);
-  jit_prolog();
-  in = jit_arg();
-  stack_ptr = stack_base = jit_allocai(32 * sizeof(int));
+struct BinWriter {
+  vector<string> symbols;
+  unordered_map<string, uint64_t> ids;
 
-  jit_getarg(JIT_R2, in);
+  uint64_t intern(const string &name) {
+    auto [it, added] = ids.emplace(name, symbols.size());
+    if (added)
+      symbols.push_back(name);
+    return it->second;
+  }
 
-  while (*expr) {
-    char buf[32];
-    int n;
-    if (sscanf(expr, "%[0-9]%n", buf, &n)) {
-      expr += n - 1;
-      stack_push(JIT_R0, &stack_ptr);
-      jit_movi(JIT_R0, atoi(buf));
-    } else if (*expr == '+') {
-      stack_pop(JIT_R1, &stack_ptr);
-      jit_addr(JIT_R0, JIT_R1, JIT_R0);
-    } else if (*expr == '-') {
-      stack_pop(JIT_R1, &stack_ptr);
-      jit_subr(JIT_R0, JIT_R1, JIT_R0);
-    } else if (*expr == '*') {
-      stack_pop(JIT_R1, &stack_ptr);
-      jit_mulr(JIT_R0, JIT_R1, JIT_R0);
-    } else if (*expr == '/') {
-      stack_pop(JIT_R1, &stack_ptr);
-      jit_divr(JIT_R0, JIT_R1, JIT_R0);
-    } else if (*expr == '(' || *expr == ')' || *expr == ' ') {
-      ++expr;
-      continue;
+  void encode(const S &s, string &code) {
+    for (const auto &r : s.rest)
+      encode(*r, code);
+    const string &h = s.head;
+    size_t arity = s.rest.size();
+    bool op = h.size() == 1 && ispunct(h[0]);
+    if (arity == 0 && isdigit(h[0]) && h.size() < 19 &&
+        std::to_string(stoll(h)) == h) {
+      code += char(BIN_CONST);
+      int64_t v = stoll(h);
+      put_varint(code, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+    } else if (arity == 0 && !op) {
+      code += char(BIN_SYMBOL);
+      put_varint(code, intern(h));
+    } else if (op && arity == (h[0] == '?' ? 3u : 2u)) {
+      code += h[0];
+    } else if (op && arity == 1) {
+      code += char(h[0] | 0x80);
     } else {
-      fprintf(stderr, "cannot compile: %s\n", expr);
-      abort();
+      code += char(BIN_APPLY);
+      put_varint(code, intern(h));
+      put_varint(code, arity);
     }
-    ++expr;
   }
-  jit_retr(JIT_R0);
-  jit_epilog();
-  return fn;
-}
+};
 
-pifv eval(const string line) {
-  _jit = jit_new_state();
-  auto c_expr = compile_rpn(line.c_str());
-  (void)jit_emit();
-  auto eval = (pifv)jit_address(c_expr);
-  jit_clear_state();
-  return eval;
+string save_exprs(const vector<shared_ptr<S>> &exprs) {
+  BinWriter writer;
+  vector<string> codes(exprs.size());
+  for (size_t i = 0; i < exprs.size(); ++i)
+    writer.encode(*exprs[i], codes[i]);
+
+  string out = "JXB1";
+  put_varint(out, writer.symbols.size());
+  for (const auto &sym : writer.symbols) {
+    put_varint(out, sym.size());
+    out += sym;
+  }
+  put_varint(out, codes.size());
+  for (const auto &code : codes) {
+    put_varint(out, code.size());
+    out += code;
+  }
+  return out;
 }
 
-#include <cassert>
-#include <iostream>
+// Header and per-expression code ranges of an encoded rule set; the code
+// itself is consumed in place.
+struct BinReader {
+  vector<string> symbols;
+  vector<pair<const uint8_t *, const uint8_t *>> codes;
 
-void test_single_digit() {
-  assert(expr("3")->to_string() == "3");
-  assert(expr("42")->to_string() == "42");
-}
+  BinReader(const uint8_t *p, size_t size) {
+    const uint8_t *end = p + size;
+    if (size < 4 || memcmp(p, "JXB1", 4))
+      throw runtime_error("not a JXB1 expression file");
+    p += 4;
 
-void test_simple_operations() {
-  assert(expr("3 + 4")->to_string() == "3 4 +");
-  assert(expr("10 - 5")->to_string() == "10 5 -");
-  assert(expr("6 * 7")->to_string() == "6 7 *");
-  assert(expr("8 / 2")->to_string() == "8 2 /");
+    symbols.resize(get_varint(p, end));
+    for (auto &sym : symbols) {
+      uint64_t len = get_varint(p, end);
+      if (len > uint64_t(end - p))
+        throw runtime_error("truncated symbol table");
+      sym.assign((const char *)p, len);
+      p += len;
+    }
+    codes.resize(get_varint(p, end));
+    for (auto &code : codes) {
+      uint64_t len = get_varint(p, end);
+      if (len > uint64_t(end - p))
+        throw runtime_error("truncated expression");
+      code = {p, p + len};
+      p += len;
+    }
+  }
+
+  const string &symbol(uint64_t id) const {
+    if (id >= symbols.size())
+      throw runtime_error("bad symbol id");
+    return symbols[id];
+  }
+
+  // calls constant(value), leaf(symbol id) and apply(head, arity) in
+  // postfix order
+  template <typename Constant, typename Leaf, typename Apply>
+  void walk(size_t i, Constant constant, Leaf leaf, Apply apply) const {
+    auto [p, end] = codes[i];
+    while (p < end) {
+      uint8_t op = *p++;
+      if (op == BIN_CONST) {
+        uint64_t z = get_varint(p, end);
+        constant(int64_t(z >> 1) ^ -int64_t(z & 1));
+      } else if (op == BIN_SYMBOL) {
+        uint64_t id = get_varint(p, end);
+        symbol(id);
+        leaf(id);
+      } else if (op == BIN_APPLY) {
+        const string &head = symbol(get_varint(p, end));
+        apply(head, get_varint(p, end));
+      } else {
+        apply(string(1, op & 0x7f), op & 0x80 ? 1 : op == '?' ? 3 : 2);
+      }
+    }
+  }
+};
+
+vector<shared_ptr<S>> load_exprs(const uint8_t *p, size_t size) {
+  BinReader reader(p, size);
+  vector<shared_ptr<S>> exprs(reader.codes.size());
+  // leaves are never modified, so every use of a symbol shares one node
+  vector<shared_ptr<S>> leaves;
+  for (const auto &sym : reader.symbols)
+    leaves.push_back(is_identifier(sym)
+                         ? make_shared<S>(sym, symbols.intern(sym))
+                         : make_shared<S>(sym));
+  vector<shared_ptr<S>> stack;
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    stack.clear();
+    reader.walk(
+        i,
+        [&](int64_t v) { stack.push_back(make_shared<S>(std::to_string(v))); },
+        [&](uint64_t id) { stack.push_back(leaves[id]); },
+        [&](const string &head, size_t arity) {
+          if (arity > stack.size())
+            throw runtime_error("expression stack underflow");
+          vector<shared_ptr<S>> rest(stack.end() - arity, stack.end());
+          stack.resize(stack.size() - arity);
+          stack.push_back(make_shared<S>(head, std::move(rest)));
+        });
+    if (stack.size() != 1)
+      throw runtime_error("malformed expression");
+    exprs[i] = stack.back();
+  }
+  return exprs;
 }
 
-void test_operator_precedence() {
-  assert(expr("3 + 4 * 5")->to_string() == "3 4 5 * +");
-  assert(expr("10 - 5 / 5")->to_string() == "10 5 5 / -");
-  assert(expr("1 + 2 * 3 - 4 / 5")->to_string() == "1 2 3 * + 4 5 / -");
+// The rpn text compile_rpn takes, written straight from the postfix code
+// without building a tree; this is the fast path for loading rule sets.
+vector<string> load_rpns(const uint8_t *p, size_t size) {
+  BinReader reader(p, size);
+  vector<string> rpns(reader.codes.size());
+  for (size_t i = 0; i < rpns.size(); ++i) {
+    string &rpn = rpns[i];
+    long depth = 0;
+    auto word = [&](string_view text) {
+      if (!rpn.empty() && !text.empty())
+        rpn += ' ';
+      rpn += text;
+    };
+    reader.walk(
+        i,
+        [&](int64_t v) {
+          char digits[24];
+          word(string_view(digits, to_chars(digits, digits + 24, v).ptr -
+                                       digits));
+          ++depth;
+        },
+        [&](uint64_t id) {
+          word(reader.symbols[id]);
+          ++depth;
+        },
+        [&](const string &head, size_t arity) {
+          if ((size_t)depth < arity)
+            throw runtime_error("expression stack underflow");
+          word(rpn_word(head, arity));
+          depth -= arity - 1;
+        });
+    if (depth != 1)
+      throw runtime_error("malformed expression");
+  }
+  return rpns;
 }
 
-void test_parentheses() {
-  assert(expr("(3 + 4) * 5")->to_string() == "3 4 + 5 *");
-  assert(expr("(1 + 2) * (3 - 4)")->to_string() == "1 2 + 3 4 - *");
+void save_exprs_file(const string &path, const vector<shared_ptr<S>> &exprs) {
+  string bytes = save_exprs(exprs);
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+    if (f)
+      fclose(f);
+    throw runtime_error("cannot write " + path);
+  }
+  fclose(f);
 }
 
-void test_nested_parentheses() {
-  assert(expr("((3 + 4) * 5) / 2")->to_string() == "3 4 + 5 * 2 /");
-  assert(expr("(1 + (2 * 3)) - (4 / (5 + 6))")->to_string() ==
-         "1 2 3 * + 4 5 6 + / -");
+// decodes straight out of the page cache; nothing is read() or copied
+template <typename Load>
+auto load_mapped(const string &path, Load load) -> decltype(load(nullptr, 0)) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("cannot open " + path);
+  struct stat st;
+  fstat(fd, &st);
+  void *data = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0)
+                          : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED)
+    throw runtime_error("cannot mmap " + path);
+  try {
+    auto loaded = load((const uint8_t *)data, st.st_size);
+    munmap(data, st.st_size);
+    return loaded;
+  } catch (...) {
+    munmap(data, st.st_size);
+    throw;
+  }
 }
 
-void test_complex_expressions() {
-  assert(expr("3 + 4 * 2 / (1 - 5) + 6")->to_string() ==
-         "3 4 2 * 1 5 - / + 6 +");
-  assert(expr("42 * (35 + 12) / (7 - 3) + 8")->to_string() ==
-         "42 35 12 + * 7 3 - / 8 +");
+vector<shared_ptr<S>> load_exprs_file(const string &path) {
+  return load_mapped(path, load_exprs);
 }
 
-void test_unary_operations() {
-  assert(expr("-3")->to_string() == "3 -");
-  assert(expr("+42")->to_string() == "42 +");
-  assert(expr("-3 + 4")->to_string() == "3 - 4 +");
-  assert(expr("-3 * (4 + 2)")->to_string() == "3 - 4 2 + *");
+vector<string> load_rpns_file(const string &path) {
+  return load_mapped(path, load_rpns);
 }
 
-void test_edge_cases() {
-  // Minimal input
-  assert(expr("1")->to_string() == "1");
+// Many parsed expressions in one contiguous postfix node array, so bulk
+// loads of rule files neither allocate per node nor scatter the trees.
+struct ArenaNode {
+  // Imaginary is a constant times i, as in 3i
+  enum Kind : uint8_t { Const, Imaginary, Symbol, Op, Call };
 
-  // Extra spaces
-  assert(expr("  3   + 4   ")->to_string() == "3 4 +");
+  int64_t value;  // the constant, or the symbol id of a name or function
+  uint32_t arity; // operands, which are the preceding subtrees
+  Kind kind;
+  char op[3]; // operator text, empty for a bare sequence
+};
 
-  // Complex parentheses
-  assert(expr("(((3)))")->to_string() == "3");
-  assert(expr("(3 + (4 * (5)))")->to_string() == "3 4 5 * +");
+typedef uint32_t ExprHandle;
 
-  // Multiple operators in sequence
-  assert(expr("3 + 4 - 5")->to_string() == "3 4 + 5 -");
-  assert(expr("6 * 7 / 2")->to_string() == "6 7 * 2 /");
+struct ExprArena {
+  vector<ArenaNode> nodes;
+  // expression h occupies nodes[offsets[h], offsets[h + 1])
+  vector<uint32_t> offsets{0};
 
-  // Invalid input should throw errors (commented out as assert does not catch
-  // exceptions) try { expr("+"); assert(false); } catch (...) {} // Unary +
-  // without operand try { expr("(3 + 4"); assert(false); } catch (...) {} //
-  // Mismatched parentheses try { expr(")3 + 4("); assert(false); } catch (...)
-  // {} // Invalid parentheses
-}
+  size_t size() const { return offsets.size() - 1; }
 
-void test_large_numbers() {
-  assert(expr("123 + 456")->to_string() == "123 456 +");
-  assert(expr("99999 * 88888")->to_string() == "99999 88888 *");
-  assert(expr("1234567890 - 987654321")->to_string() ==
-         "1234567890 987654321 -");
-}
+  // same text as S::to_string, i.e. the rpn compile_rpn takes
+  string to_string(ExprHandle h) const {
+    string rpn;
+    for (uint32_t i = offsets[h]; i < offsets[h + 1]; ++i) {
+      const ArenaNode &node = nodes[i];
+      string word = node.kind == ArenaNode::Const ? std::to_string(node.value)
+                    : node.kind == ArenaNode::Imaginary
+                        ? std::to_string(node.value) + "i"
+                    : node.kind == ArenaNode::Op
+                        ? string(rpn_word(
+                              string_view(node.op,
+                                          strnlen(node.op, sizeof node.op)),
+                              node.arity))
+                        : symbols.name(node.value);
+      if (!rpn.empty() && !word.empty())
+        rpn += ' ';
+      rpn += word;
+    }
+    return rpn;
+  }
 
-void test_no_operators() {
-  assert(expr("123")->to_string() == "123");
-  assert(expr("456 789")->to_string() == "456 789");
+  shared_ptr<S> tree(ExprHandle h) const {
+    vector<shared_ptr<S>> stack;
+    for (uint32_t i = offsets[h]; i < offsets[h + 1]; ++i) {
+      const ArenaNode &node = nodes[i];
+      if (node.kind == ArenaNode::Const) {
+        stack.push_back(make_shared<S>(std::to_string(node.value)));
+      } else if (node.kind == ArenaNode::Imaginary) {
+        stack.push_back(make_shared<S>(std::to_string(node.value) + "i"));
+      } else if (node.kind == ArenaNode::Symbol) {
+        stack.push_back(make_shared<S>(symbols.name(node.value), node.value));
+      } else {
+        vector<shared_ptr<S>> rest(stack.end() - node.arity, stack.end());
+        stack.resize(stack.size() - node.arity);
+        stack.push_back(make_shared<S>(
+            node.kind == ArenaNode::Call
+                ? symbols.name(node.value)
+                : string(node.op, strnlen(node.op, sizeof node.op)),
+            std::move(rest)));
+      }
+    }
+    return stack.back();
+  }
+};
+
+struct ArenaBuilder {
+  typedef uint32_t Ref;
+
+  vector<ArenaNode> &nodes;
+
+  Ref leaf(const Token &atom) {
+    ArenaNode node{0, 0, ArenaNode::Symbol, {}};
+    if (atom.sym >= 0) {
+      node.value = atom.sym;
+    } else {
+      // the value must spell the number back exactly, so there are no
+      // leading zeros, and fit the node; 3i is 3 marked imaginary
+      bool imaginary = is_imaginary(atom.value);
+      string_view digits = atom.value.substr(0, atom.value.size() - imaginary);
+      const char *end = digits.data() + digits.size();
+      auto [ptr, ec] = from_chars(digits.data(), end, node.value);
+      if (ptr != end || ec != errc() ||
+          (digits.size() > 1 && digits[0] == '0'))
+        throw runtime_error("bad number " + string(atom.value));
+      node.kind = imaginary ? ArenaNode::Imaginary : ArenaNode::Const;
+    }
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+
+  Ref apply(string_view head, const Ref *, size_t n) {
+    ArenaNode node{0, (uint32_t)n, ArenaNode::Op, {}};
+    if (is_identifier(head)) {
+      node.kind = ArenaNode::Call;
+      node.value = symbols.intern(head);
+      nodes.push_back(node);
+      return nodes.size() - 1;
+    }
+    if (head.size() > sizeof node.op)
+      throw runtime_error("operator too long: " + string(head));
+    memcpy(node.op, head.data(), head.size());
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+};
+
+void parse_into(ExprArena &arena, const string_view *inputs, size_t n) {
+  ArenaBuilder builder{arena.nodes};
+  for (size_t i = 0; i < n; ++i) {
+    Lexer lexer(inputs[i]);
+    parse(lexer, builder);
+    arena.offsets.push_back(arena.nodes.size());
+  }
 }
 
-void test_postfix_operators() {
-  assert(expr("3!")->to_string() == "3 !");
-  assert(expr("(4 + 5)!")->to_string() == "4 5 + !");
+// Parses every input into one arena; handle h is inputs[h]. With several
+// threads each one fills a private arena over a contiguous slice of the
+// inputs, and the slices are appended in order afterwards.
+ExprArena parse_many(const vector<string_view> &inputs, unsigned threads = 1) {
+  ExprArena arena;
+  threads = max<size_t>(1, min<size_t>(threads, inputs.size() / 1024));
+  if (threads == 1) {
+    parse_into(arena, inputs.data(), inputs.size());
+    return arena;
+  }
+
+  vector<ExprArena> parts(threads);
+  vector<exception_ptr> errors(threads);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t) {
+    size_t begin = inputs.size() * t / threads;
+    size_t end = inputs.size() * (t + 1) / threads;
+    workers.emplace_back([&, t, begin, end] {
+      try {
+        parse_into(parts[t], inputs.data() + begin, end - begin);
+      } catch (...) {
+        errors[t] = current_exception();
+      }
+    });
+  }
+  for (auto &w : workers)
+    w.join();
+  for (auto &error : errors)
+    if (error)
+      rethrow_exception(error);
+
+  size_t total = 0;
+  for (const auto &part : parts)
+    total += part.nodes.size();
+  arena.nodes.reserve(total);
+  arena.offsets.reserve(inputs.size() + 1);
+  for (const auto &part : parts) {
+    uint32_t base = arena.nodes.size();
+    arena.nodes.insert(arena.nodes.end(), part.nodes.begin(), part.nodes.end());
+    for (size_t h = 1; h < part.offsets.size(); ++h)
+      arena.offsets.push_back(base + part.offsets[h]);
+  }
+  return arena;
 }
 
-int tests() {
-  test_single_digit();
-  test_simple_operations();
-  test_operator_precedence();
-  test_parentheses();
-  test_nested_parentheses();
-  test_complex_expressions();
-  test_unary_operations();
-  test_edge_cases();
-  test_large_numbers();
-  test_no_operators();
-  test_postfix_operators();
+typedef int (*pifi)(int);
+typedef int (*pifv)(void);
 
-  std::cout << "All tests passed!" << std::endl;
-  return 0;
+// the state being compiled into, one per thread so threads compile at once
+static thread_local jit_state_t *_jit;
+
+void stack_push(int reg, int *sp) {
+  jit_stxi_i(*sp, JIT_FP, reg);
+  *sp += sizeof(int);
 }
-int main(int argc, char **argv) {
+
+void stack_pop(int reg, int *sp) {
+  *sp -= sizeof(int);
+  jit_ldxi_i(reg, JIT_FP, *sp);
+}
+
+// Where a variable lives in memory for batch kernels: element i of the
+// column is the int at bases[k] + i * stride + offset, so SoA columns use
+// stride sizeof(int) and AoS fields use sizeof(record) and offsetof(field).
+//
+// A column may also hold a small vector or row-major matrix per row; its
+// elements are consecutive ints starting at the field offset.
+struct Column {
+  string name;
+  long stride;
+  long offset;
+  int sym;
+  int rows, cols;
+  // samples > 0 makes this a grid axis whose values are generated from
+  // an index instead of loaded, see emit_axis()
+  int lo = 0, hi = 0, samples = 0;
+  // complex elements are a real and an imaginary int, interleaved
+  bool complex = false;
+  // bits > 0 makes this a bit-packed scalar column decoded as it is
+  // loaded, see PackedColumn; bases[k] is the packed data, and stride and
+  // offset are unused
+  int bits = 0, reference = 0, start = 0;
+  bool delta = false;
+
+  Column(string name, long stride, long offset, int rows = 1, int cols = 1)
+      : name(std::move(name)), stride(stride), offset(offset),
+        sym(symbols.intern(this->name)), rows(rows), cols(cols) {}
+};
+
+// Frame-of-reference and delta bit packing of an int column. Row i's field
+// is the bits-wide unsigned number at bit i * bits of words, and its value
+// is reference + field, or with delta the previous row's value plus that
+// (the row before row 0 being start), so sorted or slowly changing columns
+// pack into a few bits a row. Kernels read the fields in place: column()
+// describes the packing for eval_batch(), with data() as the bases entry,
+// and rows are counted from the start of the data on every call.
+struct PackedColumn {
+  vector<uint64_t> words; // and one more, so any field is one 8-byte load
+  int bits = 1, reference = 0, start = 0;
+  bool delta = false;
+  size_t size = 0;
+
+  static PackedColumn pack(const vector<int> &values, bool delta = false) {
+    PackedColumn p;
+    p.delta = delta, p.size = values.size();
+    vector<uint32_t> fields(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+      fields[i] = delta && i ? uint32_t(values[i]) - uint32_t(values[i - 1])
+                             : uint32_t(values[i]);
+    // row 0's delta is from start, chosen so that it costs nothing
+    auto from = fields.begin() + (delta && fields.size() > 1);
+    if (from != fields.end())
+      p.reference = int(*min_element(from, fields.end(),
+                                     [](uint32_t a, uint32_t b) {
+                                       return int(a) < int(b);
+                                     }));
+    if (delta && !fields.empty()) {
+      p.start = int(fields[0] - uint32_t(p.reference));
+      fields[0] = p.reference;
+    }
+    uint32_t top = 0;
+    for (auto &f : fields)
+      top = max(top, f -= uint32_t(p.reference));
+    while (p.bits < 32 && top >> p.bits)
+      ++p.bits;
+    p.words.assign((values.size() * p.bits + 63) / 64 + 1, 0);
+    for (size_t i = 0; i < fields.size(); ++i) {
+      size_t bit = i * p.bits;
+      p.words[bit / 64] |= uint64_t(fields[i]) << (bit % 64);
+      if (bit % 64 + p.bits > 64)
+        p.words[bit / 64 + 1] |= uint64_t(fields[i]) >> (64 - bit % 64);
+    }
+    return p;
+  }
+
+  vector<int> unpack() const {
+    vector<int> values(size);
+    uint32_t value = start;
+    const uint8_t *bytes = (const uint8_t *)words.data();
+    for (size_t i = 0; i < size; ++i) {
+      uint64_t word;
+      memcpy(&word, bytes + i * bits / 8, sizeof word);
+      uint32_t field = (word >> (i * bits % 8)) & (~0ull >> (64 - bits));
+      value = (delta ? value : 0) + uint32_t(reference) + field;
+      values[i] = int(value);
+    }
+    return values;
+  }
+
+  Column column(const string &name) const {
+    Column col(name, 0, 0);
+    col.bits = bits, col.reference = reference, col.start = start;
+    col.delta = delta;
+    return col;
+  }
+
+  const void *data() const { return words.data(); }
+};
+
+struct Shape {
+  int rows, cols;
+  bool complex = false;
+
+  bool scalar() const { return rows == 1 && cols == 1; }
+  int size() const { return rows * cols; }
+  bool operator==(const Shape &o) const {
+    return rows == o.rows && cols == o.cols;
+  }
+};
+
+// Checks the shapes of vector and matrix operations against the columns
+// and rewrites the expression into scalar code, fully unrolled: element
+// (r, c) of a column is the leaf "name@k" with k = r * cols + c.
+// Element-wise arithmetic and bitwise operators broadcast scalars, '*'
+// with a matrix on the left is a matrix product, and dot() and sum()
+// reduce to a scalar. Reductions are balanced trees so the products are
+// independent of each other.
+//
+// Complex values have int parts, and every element lowers to a real and
+// an imaginary tree: a complex column keeps them interleaved, at name@2k
+// and name@2k+1, and a literal such as 3i is an imaginary part alone.
+// + - * / take complex operands, as do conj(), re(), im(), norm(), abs()
+// (the floor of the modulus) and arg() (the angle in 1/65536 radians).
+class ShapeLowering {
+public:
+  // im is null for a real value
+  struct Value {
+    shared_ptr<S> re, im = nullptr;
+  };
+
+  explicit ShapeLowering(const vector<Column> &columns) : columns(columns) {}
+
+  Shape shape(const shared_ptr<S> &s) {
+    if (auto it = shapes.find(s.get()); it != shapes.end())
+      return it->second;
+    Shape sh = infer(*s);
+    shapes[s.get()] = sh;
+    return sh;
+  }
+
+  Value elem(const shared_ptr<S> &s, int r, int c) {
+    auto key = make_tuple(s.get(), r, c);
+    if (auto it = values.find(key); it != values.end())
+      return it->second;
+    return values[key] = lower(s, r, c);
+  }
+
+private:
+  const vector<Column> &columns;
+  unordered_map<const S *, Shape> shapes;
+  map<tuple<const S *, int, int>, Value> values;
+
+  Value lower(const shared_ptr<S> &s, int r, int c) {
+    Shape sh = shape(s);
+    const string &h = s->head;
+    if (s->rest.empty()) {
+      if (is_imaginary(h))
+        return {leaf(0), leaf_of(h.substr(0, h.size() - 1))};
+      int k = r * sh.cols + c;
+      if (sh.complex)
+        return {element(h, 2 * k), element(h, 2 * k + 1)};
+      if (sh.scalar())
+        return {s};
+      return {element(h, k)};
+    }
+    if (h == "dot") {
+      vector<Value> terms;
+      Shape arg = shape(s->rest[0]);
+      for (int i = 0; i < arg.rows; ++i)
+        for (int j = 0; j < arg.cols; ++j)
+          terms.push_back(mul(elem(s->rest[0], i, j), elem(s->rest[1], i, j)));
+      return sum(terms);
+    }
+    if (h == "sum") {
+      vector<Value> terms;
+      Shape arg = shape(s->rest[0]);
+      for (int i = 0; i < arg.rows; ++i)
+        for (int j = 0; j < arg.cols; ++j)
+          terms.push_back(elem(s->rest[0], i, j));
+      return sum(terms);
+    }
+    if (h == "[]") {
+      // a constant index is checked here, any other one by the kernel
+      auto index = elem(s->rest[1], 0, 0).re;
+      const string &name = s->rest[0]->head;
+      if (!is_number(index->head))
+        return {make_shared<S>(name + "[]", vector<shared_ptr<S>>{index})};
+      if (stoll(index->head) >= shape(s->rest[0]).size())
+        mismatch(*s, "index out of range");
+      return {element(name, stoll(index->head))};
+    }
+    if (h == "*" && s->rest.size() == 2 && matrix_product(*s)) {
+      vector<Value> terms;
+      for (int k = 0; k < shape(s->rest[0]).cols; ++k)
+        terms.push_back(mul(elem(s->rest[0], r, k), elem(s->rest[1], k, c)));
+      return sum(terms);
+    }
+    // element-wise, with scalar operands broadcast
+    vector<Value> args;
+    for (const auto &arg : s->rest)
+      args.push_back(shape(arg).scalar() ? elem(arg, 0, 0) : elem(arg, r, c));
+    if (sh.complex || part_of_complex(h) ||
+        any_of(args.begin(), args.end(), [](const Value &v) { return v.im; }))
+      return complex_op(h, args);
+    vector<shared_ptr<S>> rest;
+    for (const auto &arg : args)
+      rest.push_back(arg.re);
+    return {make_shared<S>(h, std::move(rest))};
+  }
+
+  Value complex_op(const string &h, const vector<Value> &args) {
+    const Value &a = args[0];
+    shared_ptr<S> im = a.im ? a.im : leaf(0);
+    if (h == "conj")
+      return {a.re, a.im ? op("-", leaf(0), a.im) : nullptr};
+    if (h == "re")
+      return {a.re};
+    if (h == "im")
+      return {im};
+    if (h == "norm")
+      return {norm(a)};
+    if (h == "abs" && !a.im) {
+      // (x ^ (x >> 31)) - (x >> 31)
+      auto sign = op(">>", a.re, leaf(31));
+      return {op("-", op("^", a.re, sign), sign)};
+    }
+    if (h == "abs")
+      return {make_shared<S>("isqrt", vector<shared_ptr<S>>{norm(a)})};
+    if (h == "arg")
+      return {make_shared<S>("iatan2", vector<shared_ptr<S>>{im, a.re})};
+    if (args.size() == 1)
+      return h == "-" ? sub({leaf(0)}, a) : a;
+    const Value &b = args[1];
+    if (h == "+")
+      return add(a, b);
+    if (h == "-")
+      return sub(a, b);
+    if (h == "*")
+      return mul(a, b);
+    // (a + bi) / (c + di) = ((ac + bd) + (bc - ad)i) / (c^2 + d^2)
+    if (!b.im)
+      return {op("/", a.re, b.re), a.im ? op("/", a.im, b.re) : nullptr};
+    Value n = mul(a, {b.re, op("-", leaf(0), b.im)});
+    auto d = norm(b);
+    return {op("/", n.re, d), op("/", n.im, d)};
+  }
+
+  // the functions of one complex operand, which real operands take too
+  static bool part_of_complex(const string &h) {
+    for (const char *f : {"conj", "re", "im", "norm", "abs", "arg"})
+      if (h == f)
+        return true;
+    return false;
+  }
+
+  static shared_ptr<S> leaf(int v) { return make_shared<S>(std::to_string(v)); }
+  static shared_ptr<S> leaf_of(const string &h) { return make_shared<S>(h); }
+
+  static shared_ptr<S> element(const string &name, int k) {
+    return make_shared<S>(name + "@" + std::to_string(k));
+  }
+
+  static shared_ptr<S> op(const string &h, shared_ptr<S> a, shared_ptr<S> b) {
+    return make_shared<S>(h, vector<shared_ptr<S>>{a, b});
+  }
+
+  // parts missing on one side are zero and drop out
+  static shared_ptr<S> part(const string &h, shared_ptr<S> a,
+                            shared_ptr<S> b) {
+    if (!b)
+      return a;
+    if (!a)
+      return h == "-" ? op("-", leaf(0), b) : b;
+    return op(h, a, b);
+  }
+
+  static Value add(const Value &a, const Value &b) {
+    return {op("+", a.re, b.re), part("+", a.im, b.im)};
+  }
+
+  static Value sub(const Value &a, const Value &b) {
+    return {op("-", a.re, b.re), part("-", a.im, b.im)};
+  }
+
+  static Value mul(const Value &a, const Value &b) {
+    if (!a.im && !b.im)
+      return {op("*", a.re, b.re)};
+    if (!b.im)
+      return {op("*", a.re, b.re), op("*", a.im, b.re)};
+    if (!a.im)
+      return {op("*", a.re, b.re), op("*", a.re, b.im)};
+    return {op("-", op("*", a.re, b.re), op("*", a.im, b.im)),
+            op("+", op("*", a.re, b.im), op("*", a.im, b.re))};
+  }
+
+  static shared_ptr<S> norm(const Value &a) {
+    auto square = op("*", a.re, a.re);
+    return a.im ? op("+", square, op("*", a.im, a.im)) : square;
+  }
+
+  static shared_ptr<S> balanced(const string &op, vector<shared_ptr<S>> terms) {
+    while (terms.size() > 1) {
+      vector<shared_ptr<S>> next;
+      for (size_t i = 0; i + 1 < terms.size(); i += 2)
+        next.push_back(
+            make_shared<S>(op, vector<shared_ptr<S>>{terms[i], terms[i + 1]}));
+      if (terms.size() % 2)
+        next.push_back(terms.back());
+      terms = std::move(next);
+    }
+    return terms[0];
+  }
+
+  static Value sum(const vector<Value> &terms) {
+    vector<shared_ptr<S>> re, im;
+    for (const auto &t : terms) {
+      re.push_back(t.re);
+      if (t.im)
+        im.push_back(t.im);
+    }
+    return {balanced("+", re), im.empty() ? nullptr : balanced("+", im)};
+  }
+
+  const Column *column(const S &s) const {
+    for (const auto &col : columns)
+      if (col.sym == s.sym && !col.samples && !col.bits)
+        return &col;
+    return nullptr;
+  }
+
+  bool matrix_product(const S &s) {
+    Shape a = shape(s.rest[0]), b = shape(s.rest[1]);
+    return !a.scalar() && !b.scalar() && a.cols > 1;
+  }
+
+  [[noreturn]] static void mismatch(const S &s, const string &why) {
+    throw runtime_error("shape error in '" + s.to_string() + "': " + why);
+  }
+
+  Shape infer(const S &s) {
+    if (s.rest.empty()) {
+      if (is_imaginary(s.head))
+        return {1, 1, true};
+      for (const auto &col : columns)
+        if (col.sym == s.sym)
+          return {col.rows, col.cols, col.complex};
+      return {1, 1};
+    }
+
+    vector<Shape> args;
+    bool complex = false;
+    for (const auto &arg : s.rest) {
+      args.push_back(shape(arg));
+      complex = complex || args.back().complex;
+    }
+    auto shape_str = [](Shape sh) {
+      return std::to_string(sh.rows) + "x" + std::to_string(sh.cols);
+    };
+
+    if (s.head == "dot") {
+      if (args.size() != 2 || !(args[0] == args[1]))
+        mismatch(s, "dot() needs two operands of the same shape");
+      return {1, 1, complex};
+    }
+    if (s.head == "sum") {
+      if (args.size() != 1)
+        mismatch(s, "sum() takes one operand");
+      return {1, 1, complex};
+    }
+    if (s.head == "[]") {
+      if (!s.rest[0]->rest.empty() || !column(*s.rest[0]) ||
+          !args[1].scalar() || complex)
+        mismatch(s, "only a real column can be indexed, by a real scalar");
+      return {1, 1};
+    }
+    if (s.head == "*" && args.size() == 2 && matrix_product(s)) {
+      if (args[0].cols != args[1].rows)
+        mismatch(s, "cannot multiply " + shape_str(args[0]) + " by " +
+                        shape_str(args[1]));
+      return {args[0].rows, args[1].cols, complex};
+    }
+    if (part_of_complex(s.head)) {
+      if (args.size() != 1)
+        mismatch(s, s.head + "() takes one operand");
+      return {args[0].rows, args[0].cols, s.head == "conj" && complex};
+    }
+    if (complex && !(s.head.size() == 1 && strchr("+-*/", s.head[0])))
+      mismatch(s, "'" + s.head + "' does not take complex operands");
+    // lowered bucket#k and piecewise#k apply to each element too
+    bool elementwise = s.head == "<<" || s.head == ">>" || s.head == ">>>" ||
+                       s.head.find('#') != string::npos ||
+                       (s.head.size() == 1 && strchr("+-*/&|^~", s.head[0]));
+    bool loop = s.head.compare(0, 4, "sum#") == 0 ||
+                s.head.compare(0, 5, "prod#") == 0 ||
+                s.head.compare(0, 5, "next#") == 0 ||
+                s.head.compare(0, 4, "end#") == 0;
+    Shape result = {1, 1};
+    for (Shape arg : args) {
+      if (arg.scalar())
+        continue;
+      if (loop)
+        mismatch(s, "sum() and prod() take scalar bounds and bodies");
+      if (!elementwise)
+        mismatch(s, "'" + s.head + "' only takes scalars");
+      if (!result.scalar() && !(result == arg))
+        mismatch(s, shape_str(result) + " and " + shape_str(arg) +
+                        " operands");
+      result = arg;
+    }
+    result.complex = complex;
+    return result;
+  }
+};
+
+// Scalar form of an expression over vector and matrix columns. A
+// non-scalar result becomes a sequence of its elements in row-major
+// order, a complex one of real and imaginary parts, and *width is set to
+// the number of ints per output row.
+shared_ptr<S> lower_shapes(const shared_ptr<S> &e,
+                           const vector<Column> &columns, int *width) {
+  ShapeLowering lowering(columns);
+  Shape sh = lowering.shape(e);
+  *width = sh.size() * (sh.complex ? 2 : 1);
+  vector<shared_ptr<S>> elements;
+  for (int r = 0; r < sh.rows; ++r)
+    for (int c = 0; c < sh.cols; ++c) {
+      auto v = lowering.elem(e, r, c);
+      elements.push_back(v.re);
+      if (sh.complex)
+        elements.push_back(v.im);
+    }
+  if (elements.size() == 1)
+    return elements[0];
+  return make_shared<S>("", std::move(elements));
+}
+
+// Host C++ functions callable from expressions as name(args...). Every
+// argument and the result are ints; the attributes tell the optimizer
+// what it may assume about a call.
+enum HostAttr : unsigned {
+  HOST_PURE = 1,      // no side effects: calls are shared and hoisted
+  HOST_CONST = 2,     // pure and reads no memory: may run at compile time
+  HOST_CHEAP = 4,     // recomputing beats keeping a result around
+  HOST_EXPENSIVE = 8, // worth a table or anything else that saves a call
+};
+
+// out[i] = f(args[0][i], ..., args[arity - 1][i]) for i < n
+typedef void (*host_vector_fn)(const int *const *args, int *out, int n);
+
+struct HostFunction {
+  string name;
+  int arity;
+  void *fn;
+  unsigned attrs;
+  host_vector_fn vectorised; // batch kernels call it once per block
+  bool pure() const { return attrs & (HOST_PURE | HOST_CONST); }
+};
+
+// a deque so kernels and the optimizer can hold on to entries, which are
+// never written once added
+static deque<HostFunction> host_functions;
+// every entry registered under a name, oldest first
+static unordered_map<int, vector<size_t>> host_by_symbol;
+static shared_mutex host_functions_mu;
+// compiles on this thread see the registry as it stood after this many
+// registrations, so code can be generated again as it first was
+static thread_local size_t host_registry_as_of = SIZE_MAX;
+
+// registering a name again replaces it for kernels compiled afterwards; the
+// old entry stays for those that hold it
+template <typename... Args>
+void register_function(const string &name, int (*fn)(Args...),
+                       unsigned attrs = 0,
+                       host_vector_fn vectorised = nullptr) {
+  static_assert((is_same_v<Args, int> && ...),
+                "host functions take and return int");
+  static_assert(sizeof...(Args) <= 6, "at most 6 arguments");
+  if (!is_identifier(name))
+    throw runtime_error("bad function name '" + name + "'");
+  int sym = symbols.intern(name);
+  HostFunction f{name, sizeof...(Args), (void *)fn, attrs, vectorised};
+  unique_lock<shared_mutex> lock(host_functions_mu);
+  host_by_symbol[sym].push_back(host_functions.size());
+  host_functions.push_back(f);
+}
+
+size_t host_registrations() {
+  shared_lock<shared_mutex> lock(host_functions_mu);
+  return host_functions.size();
+}
+
+const HostFunction *host_function(int sym) {
+  shared_lock<shared_mutex> lock(host_functions_mu);
+  auto it = host_by_symbol.find(sym);
+  if (it == host_by_symbol.end())
+    return nullptr;
+  const vector<size_t> &entries = it->second;
+  auto after = lower_bound(entries.begin(), entries.end(), host_registry_as_of);
+  return after == entries.begin() ? nullptr : &host_functions[after[-1]];
+}
+
+int call_host(const HostFunction &f, const int *a) {
+  switch (f.arity) {
+  case 0:
+    return ((int (*)())f.fn)();
+  case 1:
+    return ((int (*)(int))f.fn)(a[0]);
+  case 2:
+    return ((int (*)(int, int))f.fn)(a[0], a[1]);
+  case 3:
+    return ((int (*)(int, int, int))f.fn)(a[0], a[1], a[2]);
+  case 4:
+    return ((int (*)(int, int, int, int))f.fn)(a[0], a[1], a[2], a[3]);
+  case 5:
+    return ((int (*)(int, int, int, int, int))f.fn)(a[0], a[1], a[2], a[3],
+                                                    a[4]);
+  default:
+    return ((int (*)(int, int, int, int, int, int))f.fn)(a[0], a[1], a[2],
+                                                         a[3], a[4], a[5]);
+  }
+}
+
+// built-in functions, which abs() and arg() of complex values call
+int isqrt(int x) {
+  if (x <= 0)
+    return 0;
+  int64_t r = sqrt(double(x));
+  while (r * r > x)
+    --r;
+  while ((r + 1) * (r + 1) <= x)
+    ++r;
+  return r;
+}
+
+// atan2(y, x) in 1/65536 radians
+int iatan2(int y, int x) { return lround(atan2(y, x) * 65536); }
+
+static const bool builtins_registered =
+    (register_function("isqrt", isqrt, HOST_CONST | HOST_CHEAP),
+     register_function("iatan2", iatan2, HOST_CONST), true);
+
+// Constant tables of bucket() and piecewise(). Kernels point straight at
+// the ints, so the deque only ever grows and entries never move. Equal
+// tables are stored once, so compiling a rule again adds nothing.
+struct LookupTable {
+  vector<int> edges;  // ascending
+  vector<int> values; // edges.size() + 1 of them; empty for bucket()
+  // tabulate#k tables hold f(lo + (i << shift)) for x in [lo, hi]
+  int lo = 0, hi = 0, shift = 0;
+
+  bool operator==(const LookupTable &o) const {
+    return edges == o.edges && values == o.values && lo == o.lo &&
+           hi == o.hi && shift == o.shift;
+  }
+
+  size_t hash() const {
+    size_t h = 2166136261u;
+    auto mix = [&h](int v) { h = (h ^ uint32_t(v)) * 16777619u; };
+    for (int v : edges)
+      mix(v);
+    mix(edges.size());
+    for (int v : values)
+      mix(v);
+    mix(lo), mix(hi), mix(shift);
+    return h;
+  }
+};
+
+static deque<LookupTable> lookup_tables;
+static unordered_multimap<size_t, int> lookup_tables_by_hash;
+static mutex lookup_tables_mu;
+
+int add_lookup_table(LookupTable table) {
+  size_t h = table.hash();
+  lock_guard<mutex> lock(lookup_tables_mu);
+  auto [first, last] = lookup_tables_by_hash.equal_range(h);
+  for (auto it = first; it != last; ++it)
+    if (lookup_tables[it->second] == table)
+      return it->second;
+  lookup_tables.push_back(std::move(table));
+  lookup_tables_by_hash.emplace(h, lookup_tables.size() - 1);
+  return lookup_tables.size() - 1;
+}
+
+const LookupTable &lookup_table(int k) {
+  lock_guard<mutex> lock(lookup_tables_mu);
+  return lookup_tables.at(k);
+}
+
+int table_constant(const S &s) {
+  if (s.head == "-" && s.rest.size() == 1)
+    return -table_constant(*s.rest[0]);
+  if (!s.rest.empty() || !isdigit(s.head[0]) || s.head.size() > 10 ||
+      stoll(s.head) > INT32_MAX)
+    throw runtime_error("table entries must be int constants, not '" +
+                        s.to_string() + "'");
+  return stoll(s.head);
+}
+
+// bucket(x, [e0, e1, ...]) is the number of edges <= x and
+// piecewise(x, [edges], [values]) is values[bucket(x, edges)]. Both become
+// the unary rpn words "bucket#k" and "piecewise#k" on table k.
+shared_ptr<S> lower_tables(const shared_ptr<S> &e) {
+  if (e->rest.empty())
+    return e;
+  vector<shared_ptr<S>> rest;
+  for (const auto &arg : e->rest)
+    rest.push_back(lower_tables(arg));
+  if (e->head != "bucket" && e->head != "piecewise")
+    return make_shared<S>(e->head, std::move(rest));
+
+  bool piecewise = e->head == "piecewise";
+  if (rest.size() != (piecewise ? 3u : 2u) || rest[1]->head != "[" ||
+      (piecewise && rest[2]->head != "["))
+    throw runtime_error(e->head + "() takes x, [edges]" +
+                        (piecewise ? ", [values]" : ""));
+  LookupTable table;
+  for (const auto &edge : rest[1]->rest)
+    table.edges.push_back(table_constant(*edge));
+  if (!is_sorted(table.edges.begin(), table.edges.end()))
+    throw runtime_error(e->head + "() edges must be ascending");
+  if (piecewise) {
+    for (const auto &value : rest[2]->rest)
+      table.values.push_back(table_constant(*value));
+    if (table.values.size() != table.edges.size() + 1)
+      throw runtime_error("piecewise() needs one more value than edges");
+  }
+  auto word = make_shared<S>(e->head + "#" +
+                             std::to_string(add_lookup_table(table)));
+  word->rest = {rest[0]};
+  return word;
+}
+
+// Canonical form of + and * chains. Both are associative and commutative
+// on wrapping ints, so a chain is flattened, its int constants are
+// combined, and the other operands are sorted by their rpn and rebuilt as
+// a balanced tree with the constant applied last: 3 + x + 4 becomes
+// "x 7 +", and a + b and b + a compile to the same rpn. Operands that call
+// impure host functions keep their order. Only for scalar trees, since *
+// of matrices does not commute.
+bool int_literal(const S &s, uint32_t *value) {
+  if (!s.rest.empty() || !is_number(s.head) || s.head.size() > 10 ||
+      stoll(s.head) > INT32_MAX)
+    return false;
+  *value = stoll(s.head);
+  return true;
+}
+
+bool impure_call(const S &s) {
+  const HostFunction *f = s.sym >= 0 ? host_function(s.sym) : nullptr;
+  return f && !f->pure();
+}
+
+bool has_effects(const S &s) {
+  if (s.head == "=" || impure_call(s))
+    return true;
+  for (const auto &arg : s.rest)
+    if (has_effects(*arg))
+      return true;
+  return false;
+}
+
+void flatten(const string &op, const shared_ptr<S> &e,
+             vector<shared_ptr<S>> &operands) {
+  if (e->head == op && e->rest.size() == 2) {
+    flatten(op, e->rest[0], operands);
+    flatten(op, e->rest[1], operands);
+  } else {
+    operands.push_back(e);
+  }
+}
+
+shared_ptr<S> balanced(const string &op, const vector<shared_ptr<S>> &terms,
+                       size_t lo, size_t hi) {
+  if (hi - lo == 1)
+    return terms[lo];
+  size_t mid = lo + (hi - lo) / 2;
+  return make_shared<S>(op, vector<shared_ptr<S>>{balanced(op, terms, lo, mid),
+                                                  balanced(op, terms, mid, hi)});
+}
+
+shared_ptr<S> canonicalize(const shared_ptr<S> &e) {
+  if (e->rest.empty())
+    return e;
+  if ((e->head != "+" && e->head != "*") || e->rest.size() != 2) {
+    vector<shared_ptr<S>> rest;
+    for (const auto &arg : e->rest)
+      rest.push_back(canonicalize(arg));
+    return make_shared<S>(e->head, std::move(rest));
+  }
+
+  bool add = e->head == "+";
+  vector<shared_ptr<S>> operands, terms, literals;
+  flatten(e->head, e, operands);
+  uint32_t constant = add ? 0 : 1;
+  bool effects = false;
+  for (const auto &operand : operands) {
+    auto term = canonicalize(operand);
+    uint32_t value;
+    if (int_literal(*term, &value)) {
+      constant = add ? constant + value : constant * value;
+      literals.push_back(term);
+    } else {
+      effects = effects || has_effects(*term);
+      terms.push_back(term);
+    }
+  }
+  // a sum that wraps negative has no literal to stand for it
+  if ((int32_t)constant < 0)
+    terms.insert(terms.end(), literals.begin(), literals.end());
+
+  if (!effects) {
+    vector<pair<string, shared_ptr<S>>> keyed;
+    for (const auto &term : terms)
+      keyed.emplace_back(term->to_string(), term);
+    stable_sort(keyed.begin(), keyed.end(),
+                [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (size_t i = 0; i < terms.size(); ++i)
+      terms[i] = keyed[i].second;
+  }
+
+  auto literal = make_shared<S>(std::to_string(constant));
+  if (terms.empty())
+    return literal;
+  auto tree = balanced(e->head, terms, 0, terms.size());
+  if ((int32_t)constant < 0 || constant == (add ? 0u : 1u))
+    return tree;
+  return make_shared<S>(e->head, vector<shared_ptr<S>>{tree, literal});
+}
+
+// x is clamped into [lo, hi]; between samples the value is interpolated
+// linearly, exactly as the kernel does it
+int tabulated_value(const LookupTable &t, int x) {
+  int64_t d = min(max(int64_t(x) - t.lo, int64_t(0)), int64_t(t.hi) - t.lo);
+  if (t.shift == 0)
+    return t.values[d];
+  int64_t v0 = t.values[d >> t.shift], v1 = t.values[(d >> t.shift) + 1];
+  return v0 + ((v1 - v0) * (d & ((1 << t.shift) - 1)) >> t.shift);
+}
+
+// value of a lowered table word on x
+int lookup_value(string_view word, const LookupTable &t, int x) {
+  if (word == "tabulate")
+    return tabulated_value(t, x);
+  int b = upper_bound(t.edges.begin(), t.edges.end(), x) - t.edges.begin();
+  return word == "bucket" ? b : t.values[b];
+}
+
+// s at variable sym = x with the kernels' int semantics; false if s is
+// not a pure function of sym alone or is undefined there
+bool eval_pure(const S &s, int sym, int x, int *out) {
+  if (const HostFunction *f = host_function(s.sym);
+      f && f->arity == (int)s.rest.size()) {
+    int args[6];
+    for (size_t i = 0; i < s.rest.size(); ++i)
+      if (!eval_pure(*s.rest[i], sym, x, &args[i]))
+        return false;
+    if (!(f->attrs & HOST_CONST))
+      return false;
+    *out = call_host(*f, args);
+    return true;
+  }
+  if (s.rest.empty()) {
+    if (sym >= 0 && s.sym == sym)
+      *out = x;
+    else if (is_number(s.head))
+      *out = strtoll(s.head.c_str(), nullptr, 10);
+    else
+      return false;
+    return true;
+  }
+  if (s.rest.size() > 2)
+    return false;
+  int a[2] = {};
+  for (size_t i = 0; i < s.rest.size(); ++i)
+    if (!eval_pure(*s.rest[i], sym, x, &a[i]))
+      return false;
+  const string &h = s.head;
+  unsigned ua = a[0];
+  if (s.rest.size() == 1) {
+    if (size_t hash = h.find('#'); hash != string::npos) {
+      string_view word = string_view(h).substr(0, hash);
+      if (word != "bucket" && word != "piecewise" && word != "tabulate")
+        return false;
+      *out = lookup_value(word, lookup_table(atoi(h.c_str() + hash + 1)),
+                          a[0]);
+    }
+    else if (h == "-")
+      *out = -ua;
+    else if (h == "+")
+      *out = a[0];
+    else if (h == "~")
+      *out = ~a[0];
+    else
+      return false;
+    return true;
+  }
+  unsigned ub = a[1], count = a[1] & 31;
+  if (h == "+")
+    *out = ua + ub;
+  else if (h == "-")
+    *out = ua - ub;
+  else if (h == "*")
+    *out = ua * ub;
+  else if (h == "/" && a[1] != 0)
+    *out = int64_t(a[0]) / a[1];
+  else if (h == "&")
+    *out = a[0] & a[1];
+  else if (h == "|")
+    *out = a[0] | a[1];
+  else if (h == "^")
+    *out = a[0] ^ a[1];
+  else if (h == "<<")
+    *out = ua << count;
+  else if (h == ">>")
+    *out = a[0] >> count;
+  else if (h == ">>>")
+    *out = ua >> count;
+  else
+    return false;
+  return true;
+}
+
+// Relaxed mode. A costly pure subexpression of a single variable whose
+// range the caller vouches for is evaluated at compile time for every
+// input in the range and replaced by a table load. With max_error > 0 only
+// every 2^shift-th input is kept and the kernel interpolates; the
+// sparsest table whose error, measured over the whole range, stays within
+// the bound wins. Inputs outside the range are clamped into it.
+struct VarRange {
+  string name;
+  int lo, hi;
+};
+
+struct TabulateOptions {
+  vector<VarRange> ranges;
+  int max_error = 0;
+  size_t max_entries = 4096;
+  int min_cost = 8; // cheaper subexpressions are not worth a load
+};
+
+struct TabulateStats {
+  int tables = 0;
+  int max_error = 0; // largest error measured in any table
+  size_t bytes = 0;
+};
+
+class Tabulator {
+public:
+  Tabulator(const TabulateOptions &options, TabulateStats *stats)
+      : options(options), stats(stats) {}
+
+  shared_ptr<S> rewrite(const shared_ptr<S> &s) {
+    if (s->rest.empty())
+      return s;
+    if (int sym = free_variable(*s); sym >= 0 && cost(*s) >= options.min_cost)
+      for (const auto &range : options.ranges)
+        if (symbols.find(range.name) == sym)
+          if (auto word = table(s, sym, range))
+            return word;
+    vector<shared_ptr<S>> rest;
+    for (const auto &arg : s->rest)
+      rest.push_back(rewrite(arg));
+    return make_shared<S>(s->head, std::move(rest));
+  }
+
+private:
+  static const int64_t MAX_SPAN = 1 << 20;
+  static const int MAX_SHIFT = 16;
+  const TabulateOptions &options;
+  TabulateStats *stats;
+
+  // the one variable s depends on, -1 for none, -2 for several
+  static int free_variable(const S &s) {
+    if (s.rest.empty())
+      return isdigit(s.head[0]) || host_function(s.sym) ? -1
+             : s.sym >= 0                                ? s.sym
+                                                         : -2;
+    int sym = -1;
+    for (const auto &arg : s.rest) {
+      int v = free_variable(*arg);
+      if (v == -2 || (v >= 0 && sym >= 0 && v != sym))
+        return -2;
+      sym = max(sym, v);
+    }
+    return sym;
+  }
+
+  // rough cycles: calls and divides dominate, multiplies and table
+  // words next
+  static int cost(const S &s) {
+    const HostFunction *f = host_function(s.sym);
+    int c = f && f->attrs & HOST_EXPENSIVE      ? 50
+            : f && f->attrs & HOST_CHEAP        ? 2
+            : f                                 ? 10
+            : s.rest.empty()                    ? 0
+            : s.head == "/"                     ? 20
+            : s.head == "*"                     ? 3
+            : s.head.find('#') != string::npos ? 6
+                                                : 1;
+    for (const auto &arg : s.rest)
+      c += cost(*arg);
+    return c;
+  }
+
+  shared_ptr<S> table(const shared_ptr<S> &s, int sym, const VarRange &r) {
+    int64_t span = int64_t(r.hi) - r.lo;
+    if (span < 0 || span >= MAX_SPAN)
+      return nullptr;
+    vector<int> exact(span + 1);
+    for (int64_t i = 0; i <= span; ++i)
+      if (!eval_pure(*s, sym, r.lo + i, &exact[i]))
+        return nullptr;
+
+    int shift = min(int(MAX_SHIFT), span ? 63 - __builtin_clzll(span) : 0);
+    for (; shift >= 0; --shift) {
+      // one sample past the end so the last interval can interpolate
+      size_t entries = shift ? (span >> shift) + 2 : span + 1;
+      if (entries > options.max_entries)
+        break;
+      LookupTable t;
+      t.lo = r.lo, t.hi = r.hi, t.shift = shift;
+      for (size_t i = 0; i < entries; ++i)
+        t.values.push_back(exact[min<int64_t>(int64_t(i) << shift, span)]);
+      int64_t error = 0;
+      for (int64_t i = 0; i <= span && error <= options.max_error; ++i)
+        error = max<int64_t>(
+            error, llabs(int64_t(tabulated_value(t, r.lo + i)) - exact[i]));
+      if (error > options.max_error)
+        continue;
+      if (stats) {
+        ++stats->tables;
+        stats->max_error = max<int64_t>(stats->max_error, error);
+        stats->bytes += entries * sizeof(int);
+      }
+      auto word = make_shared<S>("tabulate#" +
+                                 std::to_string(add_lookup_table(t)));
+      word->rest = {make_shared<S>(symbols.name(sym), sym)};
+      return word;
+    }
+    return nullptr;
+  }
+};
+
+shared_ptr<S> tabulate(const shared_ptr<S> &e, const TabulateOptions &options,
+                       TabulateStats *stats = nullptr) {
+  return Tabulator(options, stats).rewrite(lower_tables(e));
+}
+
+// length of the operator word at p, or 0
+int rpn_op_len(const char *p) {
+  if (!strncmp(p, ">>>", 3))
+    return 3;
+  if (!strncmp(p, ">>", 2) || !strncmp(p, "<<", 2))
+    return 2;
+  return *p && strchr("+-*/&|^~", *p) ? 1 : 0;
+}
+
+// Optimization passes over lowered scalar trees, run between parsing and
+// code generation. A pass returns its tree rewritten and counts the
+// rewrites it made; each is registered with the lowest level it runs at.
+// -O0 runs none, -O1 the cheap local folds, -O2 (the default) adds
+// reassociation and common subexpressions, and -O3 range analysis. Passes
+// and the generated code agree on one integer model, every operator's
+// result wrapping to an int, so no level changes what a formula computes.
+static int opt_level = 2;
+
+// Set for rule sets too big for the instruction cache: code is generated
+// for fewer bytes rather than for speed. Table words call one shared
+// out-of-line copy instead of being expanded inline, sum() and prod() run
+// one body a trip instead of being unrolled, and frames are sized to the
+// expression so slot offsets stay short. Vector and matrix operations are
+// still unrolled element by element. Per thread, like the compile it
+// steers.
+static thread_local bool optimize_size = false;
+
+typedef function<shared_ptr<S>(const shared_ptr<S> &, const vector<VarRange> &,
+                               size_t *)>
+    TreePass;
+
+shared_ptr<S> int_leaf(uint32_t value) {
+  return make_shared<S>(std::to_string(value));
+}
+
+bool is_literal(const S &s, uint32_t value) {
+  uint32_t v;
+  return int_literal(s, &v) && v == value;
+}
+
+bool is_binary_op(const S &s) {
+  return s.rest.size() == 2 && rpn_op_len(s.head.c_str()) == (int)s.head.size();
+}
+
+// host calls, '?' and loops evaluate their operands on their own terms, so
+// no pass moves code into or out of them
+bool opaque(const S &s) {
+  return s.head == "?" || s.head.compare(0, 3, "fi#") == 0 ||
+         s.head.compare(0, 4, "end#") == 0 ||
+         (s.sym >= 0 && host_function(s.sym));
+}
+
+// e with new operands, or e itself when none changed
+shared_ptr<S> with_rest(const shared_ptr<S> &e, vector<shared_ptr<S>> rest) {
+  for (size_t i = 0; i < rest.size(); ++i)
+    if (rest[i] != e->rest[i])
+      return make_shared<S>(e->head, std::move(rest));
+  return e;
+}
+
+// operators whose operands are all literals become their value; negative
+// values stay as they are, as rpn has no literal for them
+shared_ptr<S> fold_constants(const shared_ptr<S> &e,
+                             const vector<VarRange> &ranges, size_t *changes) {
+  if (e->rest.empty())
+    return e;
+  vector<shared_ptr<S>> rest;
+  bool constant = true;
+  uint32_t v;
+  for (const auto &arg : e->rest) {
+    rest.push_back(fold_constants(arg, ranges, changes));
+    constant = constant && int_literal(*rest.back(), &v);
+  }
+  auto node = with_rest(e, std::move(rest));
+  int value;
+  if (constant && eval_pure(*node, -1, 0, &value) && value >= 0) {
+    ++*changes;
+    return int_leaf(value);
+  }
+  return node;
+}
+
+// identities: x + 0, x * 1, x - x, ~~x and the like
+shared_ptr<S> simplify(const shared_ptr<S> &e, const vector<VarRange> &ranges,
+                       size_t *changes) {
+  if (e->rest.empty())
+    return e;
+  vector<shared_ptr<S>> rest;
+  for (const auto &arg : e->rest)
+    rest.push_back(simplify(arg, ranges, changes));
+  auto node = with_rest(e, std::move(rest));
+  const string &h = node->head;
+  if (node->rest.size() == 1) {
+    const auto &x = node->rest[0];
+    if (h == "+" || ((h == "~" || h == "-") && x->head == h &&
+                     x->rest.size() == 1)) {
+      ++*changes;
+      return h == "+" ? x : x->rest[0];
+    }
+    return node;
+  }
+  if (!is_binary_op(*node))
+    return node;
+
+  const auto &a = node->rest[0], &b = node->rest[1];
+  auto one_of = [&h](initializer_list<const char *> ops) {
+    for (const char *op : ops)
+      if (h == op)
+        return true;
+    return false;
+  };
+  shared_ptr<S> out;
+  if (is_literal(*b, 0) && one_of({"+", "-", "|", "^", "<<", ">>", ">>>"}))
+    out = a;
+  else if (is_literal(*a, 0) && one_of({"+", "|", "^"}))
+    out = b;
+  else if (is_literal(*b, 1) && one_of({"*", "/"}))
+    out = a;
+  else if (is_literal(*a, 1) && h == "*")
+    out = b;
+  else if ((is_literal(*a, 0) || is_literal(*b, 0)) && one_of({"*", "&"}) &&
+           !has_effects(*node))
+    out = int_leaf(0);
+  else if (one_of({"-", "^", "&", "|"}) && !has_effects(*node) &&
+           a->to_string() == b->to_string())
+    out = h == "-" || h == "^" ? int_leaf(0) : a;
+  if (!out)
+    return node;
+  ++*changes;
+  return out;
+}
+
+shared_ptr<S> reassociate(const shared_ptr<S> &e, const vector<VarRange> &,
+                          size_t *changes) {
+  auto out = canonicalize(e);
+  if (out->to_string() != e->to_string())
+    ++*changes;
+  return out;
+}
+
+// Interval arithmetic over the kernels' ints, seeded with the caller's
+// variable ranges. A subtree confined to one value becomes it, and a mask
+// that keeps every bit its operand can have is dropped.
+class RangeAnalysis {
+public:
+  struct Range {
+    int64_t lo = INT32_MIN, hi = INT32_MAX;
+  };
+
+  RangeAnalysis(const vector<VarRange> &ranges, size_t *changes)
+      : ranges(ranges), changes(changes) {}
+
+  shared_ptr<S> rewrite(const shared_ptr<S> &e, Range *range) {
+    uint32_t v;
+    if (e->rest.empty()) {
+      *range = {};
+      if (int_literal(*e, &v))
+        *range = {v, v};
+      for (const auto &r : ranges)
+        if (r.name == e->head)
+          *range = {r.lo, r.hi};
+      return e;
+    }
+    *range = {};
+    // ranges only narrow inside the arms of a lowered '?', so they are safe
+    if (opaque(*e) && e->head.compare(0, 3, "fi#"))
+      return e;
+    vector<shared_ptr<S>> rest;
+    vector<Range> kids(e->rest.size());
+    for (size_t i = 0; i < e->rest.size(); ++i)
+      rest.push_back(rewrite(e->rest[i], &kids[i]));
+    auto node = with_rest(e, std::move(rest));
+    *range = of(*node, kids);
+
+    if (range->lo == range->hi && range->lo >= 0 && !has_effects(*node)) {
+      ++*changes;
+      return int_leaf(range->lo);
+    }
+    if (node->head == "&" && node->rest.size() == 2)
+      for (int i = 0; i < 2; ++i)
+        if (int_literal(*node->rest[1 - i], &v) && (v & (v + 1)) == 0 &&
+            kids[i].lo >= 0 && kids[i].hi <= v) {
+          ++*changes;
+          return node->rest[i];
+        }
+    return node;
+  }
+
+private:
+  const vector<VarRange> &ranges;
+  size_t *changes;
+
+  static Range fit(int64_t lo, int64_t hi) {
+    if (lo < INT32_MIN || hi > INT32_MAX)
+      return {};
+    return {lo, hi};
+  }
+
+  static Range corners(int64_t a, int64_t b, int64_t c, int64_t d) {
+    return fit(min({a, b, c, d}), max({a, b, c, d}));
+  }
+
+  // all ones up to the top bit of v
+  static int64_t spread(int64_t v) {
+    int64_t m = 0;
+    while (m < v)
+      m = m * 2 + 1;
+    return m;
+  }
+
+  Range of(const S &node, const vector<Range> &kids) {
+    const string &h = node.head;
+    if (kids.size() == 1) {
+      Range x = kids[0];
+      if (size_t hash = h.find('#'); hash != string::npos) {
+        string_view word = string_view(h).substr(0, hash);
+        if (word == "tee")
+          return x;
+        if (word != "bucket" && word != "piecewise")
+          return {};
+        const LookupTable &t = lookup_table(atoi(h.c_str() + hash + 1));
+        int lo = lookup_value("bucket", t, x.lo);
+        int hi = lookup_value("bucket", t, x.hi);
+        if (word == "bucket")
+          return {lo, hi};
+        auto values = minmax_element(t.values.begin() + lo,
+                                     t.values.begin() + hi + 1);
+        return {*values.first, *values.second};
+      }
+      if (h == "-")
+        return fit(-x.hi, -x.lo);
+      if (h == "~")
+        return {~x.hi, ~x.lo};
+      return h == "+" ? x : Range{};
+    }
+    if (!is_binary_op(node))
+      return {};
+
+    Range a = kids[0], b = kids[1];
+    bool count = b.lo == b.hi;
+    int c = b.lo & 31;
+    if (h == "+")
+      return fit(a.lo + b.lo, a.hi + b.hi);
+    if (h == "-")
+      return fit(a.lo - b.hi, a.hi - b.lo);
+    if (h == "*")
+      return corners(a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi);
+    if (h == "/" && (b.lo > 0 || b.hi < 0))
+      return corners(a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi);
+    if (h == "&" && (a.lo >= 0 || b.lo >= 0))
+      return {0, min<int64_t>(a.lo >= 0 ? a.hi : INT32_MAX,
+                              b.lo >= 0 ? b.hi : INT32_MAX)};
+    if ((h == "|" || h == "^") && a.lo >= 0 && b.lo >= 0)
+      return {h == "|" ? max(a.lo, b.lo) : 0, spread(max(a.hi, b.hi))};
+    if (h == "<<" && count)
+      return fit(a.lo * (int64_t(1) << c), a.hi * (int64_t(1) << c));
+    if ((h == ">>" || (h == ">>>" && a.lo >= 0)) && count)
+      return {a.lo >> c, a.hi >> c};
+    if (h == ">>>" && count && c > 0)
+      return {0, int64_t(UINT32_MAX) >> c};
+    if ((h == ">>" || h == ">>>") && a.lo >= 0)
+      return {0, a.hi};
+    return {};
+  }
+};
+
+shared_ptr<S> analyse_ranges(const shared_ptr<S> &e,
+                             const vector<VarRange> &ranges, size_t *changes) {
+  RangeAnalysis::Range range;
+  return RangeAnalysis(ranges, changes).rewrite(e, &range);
+}
+
+// Subtrees of at least MIN_NODES nodes that occur more than once are
+// computed once: the first occurrence becomes tee#k, which keeps its value
+// in temp k, and the others read it back as tmp#k. Equal subtrees are
+// found by numbering them bottom up, so the cost stays linear.
+class CommonSubexpressions {
+public:
+  static const int MIN_NODES = 3;
+
+  explicit CommonSubexpressions(size_t *changes) : changes(changes) {}
+
+  shared_ptr<S> rewrite(const shared_ptr<S> &e) {
+    number(*e, true);
+    // the copies of a shared subtree after the first are never evaluated,
+    // nor is anything inside them
+    vector<int> order(info.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(),
+         [this](int a, int b) { return info[a].nodes > info[b].nodes; });
+    for (int c : order)
+      if (shared(info[c]))
+        discount(c, info[c].uses - 1);
+    return share(e);
+  }
+
+private:
+  struct Class {
+    int nodes, uses = 0, temp = -1;
+    bool effects, opaque;
+    vector<int> kids;
+  };
+  map<pair<string, vector<int>>, int> classes;
+  unordered_map<const S *, int> ids;
+  vector<Class> info;
+  int temps = 0;
+  size_t *changes;
+
+  int number(const S &s, bool counted) {
+    vector<int> kids;
+    int nodes = 1;
+    bool effects = s.head == "=" || impure_call(s);
+    for (const auto &arg : s.rest) {
+      kids.push_back(number(*arg, counted && !opaque(s)));
+      nodes += info[kids.back()].nodes;
+      effects = effects || info[kids.back()].effects;
+    }
+    auto [it, added] = classes.try_emplace({s.head, kids}, info.size());
+    if (added)
+      info.push_back({nodes, 0, -1, effects, opaque(s), kids});
+    ids[&s] = it->second;
+    if (counted)
+      ++info[it->second].uses;
+    return it->second;
+  }
+
+  static bool shared(const Class &c) {
+    return c.uses > 1 && c.nodes >= MIN_NODES && !c.effects;
+  }
+
+  void discount(int c, int copies) {
+    if (info[c].opaque)
+      return;
+    for (int kid : info[c].kids) {
+      info[kid].uses -= copies;
+      discount(kid, copies);
+    }
+  }
+
+  shared_ptr<S> share(const shared_ptr<S> &e) {
+    Class &c = info[ids[e.get()]];
+    if (shared(c)) {
+      ++*changes;
+      if (c.temp >= 0)
+        return make_shared<S>("tmp#" + std::to_string(c.temp));
+      c.temp = temps++;
+      auto tee = make_shared<S>("tee#" + std::to_string(c.temp));
+      tee->rest = {share_rest(e)};
+      return tee;
+    }
+    return share_rest(e);
+  }
+
+  shared_ptr<S> share_rest(const shared_ptr<S> &e) {
+    if (opaque(*e))
+      return e;
+    vector<shared_ptr<S>> rest;
+    for (const auto &arg : e->rest)
+      rest.push_back(share(arg));
+    return with_rest(e, std::move(rest));
+  }
+};
+
+shared_ptr<S> share_subexpressions(const shared_ptr<S> &e,
+                                   const vector<VarRange> &, size_t *changes) {
+  return CommonSubexpressions(changes).rewrite(e);
+}
+
+class PassManager {
+public:
+  struct Stats {
+    string name;
+    int level;
+    size_t runs = 0, changes = 0;
+    double seconds = 0;
+  };
+
+  // passes run in the order they are added
+  void add(string name, int level, TreePass pass) {
+    unique_lock<shared_mutex> lock(mu);
+    lock_guard<mutex> stats_lock(stats_mu);
+    passes.push_back({std::move(name), level, std::move(pass)});
+    totals.push_back({passes.back().name, level});
+  }
+
+  // compiles on several threads run their passes at once
+  shared_ptr<S> run(shared_ptr<S> e, int level,
+                    const vector<VarRange> &ranges = {}) {
+    shared_lock<shared_mutex> lock(mu);
+    for (size_t i = 0; i < passes.size(); ++i) {
+      if (passes[i].level > level)
+        continue;
+      size_t changes = 0;
+      auto start = chrono::steady_clock::now();
+      e = passes[i].pass(e, ranges, &changes);
+      double seconds =
+          chrono::duration<double>(chrono::steady_clock::now() - start)
+              .count();
+      lock_guard<mutex> stats_lock(stats_mu);
+      totals[i].seconds += seconds;
+      ++totals[i].runs;
+      totals[i].changes += changes;
+    }
+    return e;
+  }
+
+  vector<Stats> stats() const {
+    lock_guard<mutex> lock(stats_mu);
+    return totals;
+  }
+
+  void reset_stats() {
+    lock_guard<mutex> lock(stats_mu);
+    for (auto &t : totals)
+      t.runs = t.changes = 0, t.seconds = 0;
+  }
+
+private:
+  struct Pass {
+    string name;
+    int level;
+    TreePass pass;
+  };
+  vector<Pass> passes;
+  vector<Stats> totals;
+  mutable shared_mutex mu; // over passes
+  mutable mutex stats_mu;  // over totals
+};
+
+// the passes every compile goes through; common subexpressions come last,
+// as nothing after them understands tee#k and tmp#k
+PassManager &passes() {
+  static PassManager *manager = [] {
+    auto m = new PassManager;
+    m->add("fold", 1, fold_constants);
+    m->add("simplify", 1, simplify);
+    m->add("reassociate", 2, reassociate);
+    m->add("refold", 2, fold_constants);
+    m->add("ranges", 3, analyse_ranges);
+    m->add("resimplify", 3, simplify);
+    m->add("cse", 2, share_subexpressions);
+    return m;
+  }();
+  return *manager;
+}
+
+// sum(i, lo, hi, body) and prod(i, lo, hi, body) fold body over the ints
+// lo <= i < hi. A constant range of at most FULL_UNROLL ints is unrolled
+// into a balanced tree. Any other range becomes a native loop,
+//
+//   lo hi sum#k B(i) B(i+1) ... B(i+LOOP_LANES-1) next#k B(i) end#k
+//
+// that runs LOOP_LANES bodies a trip, each into its own accumulator, and
+// then the remaining ints one a trip; idx#k reads i. In size mode, and when
+// the body has a loop of its own, both are one body a trip with no
+// remainder loop.
+const int LOOP_LANES = 4, FULL_UNROLL = 16;
+
+class Comprehensions {
+public:
+  shared_ptr<S> lower(const shared_ptr<S> &e,
+                      const map<string, shared_ptr<S>> &bound = {}) {
+    if (e->rest.empty()) {
+      auto it = bound.find(e->head);
+      return it == bound.end() ? e : it->second;
+    }
+    bool product = e->head == "prod";
+    if ((e->head != "sum" && !product) || e->rest.size() != 4) {
+      vector<shared_ptr<S>> rest;
+      for (const auto &arg : e->rest)
+        rest.push_back(lower(arg, bound));
+      return with_rest(e, std::move(rest));
+    }
+
+    const auto &var = e->rest[0], &body = e->rest[3];
+    if (!var->rest.empty() || !is_identifier(var->head))
+      throw runtime_error(e->head + "() takes i, lo, hi, body");
+    auto lo = lower(e->rest[1], bound), hi = lower(e->rest[2], bound);
+    auto with = [&](shared_ptr<S> i) {
+      auto inner = bound;
+      inner[var->head] = std::move(i);
+      return lower(body, inner);
+    };
+    string op = product ? "*" : "+";
+    string k = std::to_string(next++);
+    auto idx = make_shared<S>("idx#" + k);
+    auto single = with(idx);
+    // a body that loops itself is emitted once, so nesting does not
+    // multiply the copies
+    bool nested = has_loop(single);
+    int first, last;
+    if (!nested && eval_pure(*lo, -1, 0, &first) &&
+        eval_pure(*hi, -1, 0, &last) &&
+        int64_t(last) - first <= FULL_UNROLL && !optimize_size) {
+      vector<shared_ptr<S>> terms;
+      for (int i = first; i < last; ++i)
+        terms.push_back(with(
+            i < 0 ? make_shared<S>("-", vector<shared_ptr<S>>{
+                                            int_leaf(0), int_leaf(-int64_t(i))})
+                  : int_leaf(i)));
+      if (terms.empty())
+        return int_leaf(product);
+      return balanced(op, terms, 0, terms.size());
+    }
+
+    auto loop =
+        make_shared<S>(e->head + "#" + k, vector<shared_ptr<S>>{lo, hi});
+    if (!optimize_size && !nested) {
+      vector<shared_ptr<S>> lanes = {loop, single};
+      for (int u = 1; u < LOOP_LANES; ++u)
+        lanes.push_back(with(
+            make_shared<S>("+", vector<shared_ptr<S>>{idx, int_leaf(u)})));
+      loop = make_shared<S>("next#" + k, std::move(lanes));
+    }
+    return make_shared<S>("end#" + k, vector<shared_ptr<S>>{loop, single});
+  }
+
+private:
+  static bool has_loop(const shared_ptr<S> &e) {
+    if (!e->head.compare(0, 4, "sum#") || !e->head.compare(0, 5, "prod#"))
+      return true;
+    for (const auto &arg : e->rest)
+      if (has_loop(arg))
+        return true;
+    return false;
+  }
+
+  int next = 0;
+};
+
+shared_ptr<S> lower_comprehensions(const shared_ptr<S> &e) {
+  return Comprehensions().lower(e);
+}
+
+// What a profiling run saw of each expression, saved so that later builds
+// can lay out and specialise code for it without measuring anything in
+// production. Expressions are keyed by their canonical rpn, and each '?'
+// by its own text as lower_branches() meets it.
+struct Profile {
+  struct Branch {
+    uint64_t taken = 0, not_taken = 0;
+  };
+  struct Entry {
+    uint64_t calls = 0, rows = 0, nonzero = 0;
+    vector<VarRange> ranges; // of each input column
+    map<string, Branch> branches;
+
+    // share of results that are nonzero
+    double selectivity() const { return rows ? double(nonzero) / rows : 0; }
+  };
+  map<string, Entry> entries;
+
+  static string key(const shared_ptr<S> &e) {
+    return canonicalize(e)->to_string();
+  }
+
+  const Entry *find(const shared_ptr<S> &e) const {
+    auto it = entries.find(key(e));
+    return it == entries.end() ? nullptr : &it->second;
+  }
+
+  uint64_t rows() const {
+    uint64_t n = 0;
+    for (const auto &[key, entry] : entries)
+      n += entry.rows;
+    return n;
+  }
+
+  // one line per fact, keys last as they hold spaces:
+  //   expr calls rows nonzero key
+  //   range lo hi name
+  //   branch taken not_taken key
+  void save(const string &path) const {
+    ostringstream oss;
+    for (const auto &[key, entry] : entries) {
+      oss << "expr " << entry.calls << ' ' << entry.rows << ' '
+          << entry.nonzero << ' ' << key << '\n';
+      for (const auto &r : entry.ranges)
+        oss << "range " << r.lo << ' ' << r.hi << ' ' << r.name << '\n';
+      for (const auto &[text, b] : entry.branches)
+        oss << "branch " << b.taken << ' ' << b.not_taken << ' ' << text
+            << '\n';
+    }
+    string bytes = oss.str();
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+      if (f)
+        fclose(f);
+      throw runtime_error("cannot write " + path);
+    }
+    fclose(f);
+  }
+
+  static Profile load(const string &path) {
+    return load_mapped(path, [](const uint8_t *p, size_t size) {
+      Profile profile;
+      Entry *entry = nullptr;
+      istringstream lines(string((const char *)p, size));
+      string line;
+      while (getline(lines, line)) {
+        istringstream fields(line);
+        string kind, text;
+        fields >> kind;
+        // the key or name after the numbers, which may hold spaces
+        auto rest = [&fields, &text] {
+          getline(fields >> ws, text);
+          return fields && !text.empty();
+        };
+        bool ok = false;
+        if (kind == "expr") {
+          Entry e;
+          if ((ok = fields >> e.calls >> e.rows >> e.nonzero && rest()))
+            entry = &(profile.entries[text] = e);
+        } else if (entry && kind == "range") {
+          VarRange r;
+          if ((ok = fields >> r.lo >> r.hi && rest())) {
+            r.name = text;
+            entry->ranges.push_back(r);
+          }
+        } else if (entry && kind == "branch") {
+          Branch b;
+          if ((ok = fields >> b.taken >> b.not_taken && rest()))
+            entry->branches[text] = b;
+        }
+        if (!ok)
+          throw runtime_error("malformed profile line: " + line);
+      }
+      return profile;
+    });
+  }
+};
+
+// Branch profile counters of the kernel this thread is compiling, one per
+// '?', bumped by the code of each arm; empty outside instrumented compiles.
+static thread_local vector<Profile::Branch *> branch_counters;
+
+// c ? a : b becomes "c if#k a else#k b fi#k", code that evaluates only
+// the arm it takes. When profile says c is mostly zero the arms swap
+// places as "c unless#k b else#k a fi#k", so the likely arm falls
+// through. With counters, '?' number k records into (*counters)[k].
+class BranchLowering {
+public:
+  BranchLowering(const Profile::Entry *profile,
+                 vector<Profile::Branch *> *counters,
+                 Profile::Entry *record)
+      : profile(profile), counters(counters), record(record) {}
+
+  shared_ptr<S> lower(const shared_ptr<S> &e) {
+    if (e->rest.empty())
+      return e;
+    if (e->head != "?" || e->rest.size() != 3) {
+      vector<shared_ptr<S>> rest;
+      for (const auto &arg : e->rest)
+        rest.push_back(lower(arg));
+      return with_rest(e, std::move(rest));
+    }
+    string k = std::to_string(next++), text = e->to_string();
+    if (counters)
+      counters->push_back(&record->branches[text]);
+    bool unless = false;
+    if (profile)
+      if (auto it = profile->branches.find(text);
+          it != profile->branches.end())
+        unless = it->second.not_taken > it->second.taken;
+    auto cond = lower(e->rest[0]), a = lower(e->rest[1]),
+         b = lower(e->rest[2]);
+    if (unless)
+      swap(a, b);
+    auto test = make_shared<S>((unless ? "unless#" : "if#") + k,
+                               vector<shared_ptr<S>>{cond});
+    auto first = make_shared<S>("else#" + k, vector<shared_ptr<S>>{a});
+    return make_shared<S>("fi#" + k, vector<shared_ptr<S>>{test, first, b});
+  }
+
+private:
+  const Profile::Entry *profile;
+  vector<Profile::Branch *> *counters;
+  Profile::Entry *record;
+  int next = 0;
+};
+
+shared_ptr<S> lower_branches(const shared_ptr<S> &e,
+                             const Profile::Entry *profile = nullptr) {
+  return BranchLowering(profile, nullptr, nullptr).lower(e);
+}
+
+// a literal such as 3i only means something to lower_shapes()
+void reject_imaginary(const S &s) {
+  if (is_imaginary(s.head))
+    throw runtime_error("imaginary literal " + s.head +
+                        " outside a batch expression");
+  for (const auto &arg : s.rest)
+    reject_imaginary(*arg);
+}
+
+// e lowered to what the code generators take and optimized at level
+shared_ptr<S> optimize(const shared_ptr<S> &e, int level = opt_level,
+                       const vector<VarRange> &ranges = {}) {
+  reject_imaginary(*e);
+  return passes().run(lower_branches(lower_comprehensions(lower_tables(e))),
+                      level, ranges);
+}
+
+typedef void (*pbatch)(const void *const *bases, int *out, int n);
+
+// bytes of machine code emitted so far by eval() and eval_batch()
+static atomic<size_t> code_bytes{0};
+
+// stack slots an rpn string can need: one per word bounds the depth
+int rpn_stack_slots(const char *expr) {
+  int words = 1;
+  for (const char *p = expr; *p; ++p)
+    words += *p == ' ';
+  // and a loop its bound and accumulators
+  for (const char *word : {"sum#", "prod#"})
+    for (const char *p = strstr(expr, word); p; p = strstr(p + 1, word))
+      words += LOOP_LANES + 1;
+  return optimize_size ? words + 1 : max(32, words + 1);
+}
+
+// A grid axis: bases[k] points at the index of the call's first sample,
+// and stride is 1 when the index advances with the row, 0 when it is fixed
+// for the call. Sample j is lo + (hi - lo) * j / (samples - 1) rounded
+// toward lo, one multiply: exact when the step is whole, else in 32.32
+// fixed point rounded up, which is exact up to 65536 samples.
+void emit_axis(int k, const Column &col) {
+  jit_ldxi(JIT_R0, JIT_V0, k * sizeof(void *));
+  jit_ldxi_i(JIT_R0, JIT_R0, 0);
+  if (col.stride)
+    jit_addr(JIT_R0, JIT_R0, JIT_V2);
+  uint64_t span = abs(int64_t(col.hi) - col.lo), m = max(col.samples - 1, 1);
+  if (span % m == 0) {
+    jit_muli(JIT_R0, JIT_R0, span / m);
+  } else {
+    jit_muli(JIT_R0, JIT_R0,
+             (((unsigned __int128)span << 32) + m - 1) / m);
+    jit_rshi_u(JIT_R0, JIT_R0, 32);
+  }
+  if (col.hi < col.lo)
+    jit_negr(JIT_R0, JIT_R0);
+  jit_addi(JIT_R0, JIT_R0, col.lo);
+}
+
+// R0 = the field of row V2 of a packed column plus its reference, from
+// one unaligned 8-byte load at the field's first byte
+void emit_unpack(int k, const Column &col) {
+  jit_ldxi(JIT_R0, JIT_V0, k * sizeof(void *));
+  jit_muli(JIT_R1, JIT_V2, col.bits);
+  jit_rshi_u(JIT_R2, JIT_R1, 3);
+  jit_addr(JIT_R0, JIT_R0, JIT_R2);
+  jit_ldxi(JIT_R0, JIT_R0, 0);
+  jit_andi(JIT_R1, JIT_R1, 7);
+  jit_rshr_u(JIT_R0, JIT_R0, JIT_R1);
+  jit_andi(JIT_R0, JIT_R0, ~0ull >> (64 - col.bits));
+  if (col.reference)
+    jit_addi(JIT_R0, JIT_R0, col.reference);
+  jit_extr_i(JIT_R0, JIT_R0);
+}
+
+// batch kernels keep bases in V0, out in V1 and the row index in V2
+void emit_load(int k, const Column &col, int element = 0) {
+  if (col.samples) {
+    emit_axis(k, col);
+    return;
+  }
+  if (col.bits) {
+    emit_unpack(k, col);
+    return;
+  }
+  jit_ldxi(JIT_R0, JIT_V0, k * sizeof(void *));
+  if (col.stride > 0 && (col.stride & (col.stride - 1)) == 0)
+    jit_lshi(JIT_R1, JIT_V2, __builtin_ctzl(col.stride));
+  else
+    jit_muli(JIT_R1, JIT_V2, col.stride);
+  jit_addr(JIT_R0, JIT_R0, JIT_R1);
+  jit_ldxi_i(JIT_R0, JIT_R0, col.offset + element * sizeof(int));
+}
+
+// R0 = element R0 of the row's col, or 0 when R0 is out of range
+void emit_indexed_load(int k, const Column &col, int size) {
+  jit_node_t *outside = jit_bgei_u(JIT_R0, size);
+  jit_lshi(JIT_R0, JIT_R0, 2);
+  jit_ldxi(JIT_R1, JIT_V0, k * sizeof(void *));
+  jit_addr(JIT_R1, JIT_R1, JIT_R0);
+  if (col.stride > 0 && (col.stride & (col.stride - 1)) == 0)
+    jit_lshi(JIT_R0, JIT_V2, __builtin_ctzl(col.stride));
+  else
+    jit_muli(JIT_R0, JIT_V2, col.stride);
+  jit_addr(JIT_R1, JIT_R1, JIT_R0);
+  jit_ldxi_i(JIT_R0, JIT_R1, col.offset);
+  jit_node_t *done = jit_jmpi();
+  jit_patch(outside);
+  jit_movi(JIT_R0, 0);
+  jit_patch(done);
+}
+
+// R0 = R1 op R0. Shift counts are taken mod 32 like the int operators
+// they stand for; ">>>" shifts the 32-bit pattern in as unsigned. R1 comes
+// off the stack sign-extended, R0 is when canonical is set.
+void emit_binary(string_view op, bool canonical) {
+  if (!canonical && op == "/")
+    jit_extr_i(JIT_R0, JIT_R0);
+  if (op == "+")
+    jit_addr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "-")
+    jit_subr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "*")
+    jit_mulr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "/")
+    jit_divr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "&")
+    jit_andr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "|")
+    jit_orr(JIT_R0, JIT_R1, JIT_R0);
+  else if (op == "^")
+    jit_xorr(JIT_R0, JIT_R1, JIT_R0);
+  else {
+    jit_andi(JIT_R0, JIT_R0, 31);
+    if (op == "<<") {
+      jit_lshr(JIT_R0, JIT_R1, JIT_R0);
+    } else if (op == ">>") {
+      jit_rshr(JIT_R0, JIT_R1, JIT_R0);
+    } else {
+      jit_extr_ui(JIT_R1, JIT_R1);
+      jit_rshr_u(JIT_R0, JIT_R1, JIT_R0);
+    }
+  }
+}
+
+// R0 = R0 op imm, so a constant operand never goes through the stack:
+// "(x >> 4) & 255" is a load, a shift and a mask. R0 holds a sign-extended
+// int when canonical is set. The low 32 bits of +, -, *, the bitwise ops
+// and << only depend on those of their operands, so those ops leave R0
+// as it is; division and right shifts read the whole register and extend
+// it first, so every result is the one the int operators would give.
+bool emit_binary_imm(string_view op, int imm, bool canonical) {
+  if (!canonical && (op == "/" || op == ">>"))
+    jit_extr_i(JIT_R0, JIT_R0);
+  if (op == "+")
+    jit_addi(JIT_R0, JIT_R0, imm);
+  else if (op == "-")
+    jit_subi(JIT_R0, JIT_R0, imm);
+  else if (op == "*")
+    jit_muli(JIT_R0, JIT_R0, imm);
+  else if (op == "/" && imm != 0)
+    jit_divi(JIT_R0, JIT_R0, imm);
+  else if (op == "&")
+    jit_andi(JIT_R0, JIT_R0, imm);
+  else if (op == "|")
+    jit_ori(JIT_R0, JIT_R0, imm);
+  else if (op == "^")
+    jit_xori(JIT_R0, JIT_R0, imm);
+  else if (op == "<<")
+    jit_lshi(JIT_R0, JIT_R0, imm & 31);
+  else if (op == ">>")
+    jit_rshi(JIT_R0, JIT_R0, imm & 31);
+  else if (op == ">>>") {
+    jit_extr_ui(JIT_R0, JIT_R0);
+    jit_rshi_u(JIT_R0, JIT_R0, imm & 31);
+  } else
+    return false;
+  return true;
+}
+
+// small tables unroll into a compare-and-count on immediates
+const size_t SMALL_TABLE = 8;
+
+// the out-of-line table words of optimize_size
+int bucket_stub(const LookupTable *t, int x) {
+  return upper_bound(t->edges.begin(), t->edges.end(), x) - t->edges.begin();
+}
+
+int piecewise_stub(const LookupTable *t, int x) {
+  return t->values[bucket_stub(t, x)];
+}
+
+int tabulate_stub(const LookupTable *t, int x) {
+  return tabulated_value(*t, x);
+}
+
+// R0 = bucket, piecewise or tabulate of table k applied to R0, without
+// branches. Large edge tables take a branchless binary search, log2(n)
+// dependent load-compare-add steps with R2 walking the edges, then a
+// table load; tabulated functions index their samples directly.
+void emit_lookup(string_view word, int k, bool canonical) {
+  const LookupTable &t = lookup_table(k);
+  bool piecewise = word == "piecewise";
+  size_t n = t.edges.size();
+  if (!canonical)
+    jit_extr_i(JIT_R0, JIT_R0);
+
+  if (optimize_size) {
+    jit_prepare();
+    jit_pushargi((jit_word_t)&t);
+    jit_pushargr(JIT_R0);
+    jit_finishi(word == "tabulate" ? (void *)tabulate_stub
+                : piecewise        ? (void *)piecewise_stub
+                                   : (void *)bucket_stub);
+    jit_retval_i(JIT_R0);
+    return;
+  }
+
+  if (word == "tabulate") {
+    // d = x - lo clamped to [0, span] with masks, then tabulated_value()
+    int span = int64_t(t.hi) - t.lo;
+    jit_subi(JIT_R0, JIT_R0, t.lo);
+    jit_rshi(JIT_R1, JIT_R0, sizeof(jit_word_t) * 8 - 1);
+    jit_comr(JIT_R1, JIT_R1);
+    jit_andr(JIT_R0, JIT_R0, JIT_R1);
+    jit_gti(JIT_R1, JIT_R0, span);
+    jit_negr(JIT_R1, JIT_R1);
+    jit_subi(JIT_R2, JIT_R0, span);
+    jit_andr(JIT_R2, JIT_R2, JIT_R1);
+    jit_subr(JIT_R0, JIT_R0, JIT_R2);
+    jit_movi(JIT_R1, (jit_word_t)t.values.data());
+    if (t.shift == 0) {
+      jit_lshi(JIT_R0, JIT_R0, 2);
+      jit_ldxr_i(JIT_R0, JIT_R1, JIT_R0);
+      return;
+    }
+    jit_andi(JIT_R2, JIT_R0, (1 << t.shift) - 1);
+    jit_rshi(JIT_R0, JIT_R0, t.shift);
+    jit_lshi(JIT_R0, JIT_R0, 2);
+    jit_addr(JIT_R1, JIT_R1, JIT_R0);
+    jit_ldxi_i(JIT_R0, JIT_R1, 0);
+    jit_ldxi_i(JIT_R1, JIT_R1, sizeof(int));
+    jit_subr(JIT_R1, JIT_R1, JIT_R0);
+    jit_mulr(JIT_R1, JIT_R1, JIT_R2);
+    jit_rshi(JIT_R1, JIT_R1, t.shift);
+    jit_addr(JIT_R0, JIT_R0, JIT_R1);
+    return;
+  }
+
+  if (n <= SMALL_TABLE) {
+    jit_movi(JIT_R1, piecewise ? t.values[0] : 0);
+    for (size_t i = 0; i < n; ++i) {
+      jit_gei(JIT_R2, JIT_R0, t.edges[i]);
+      if (piecewise) {
+        // step by values[i + 1] - values[i] once x reaches edges[i]
+        jit_negr(JIT_R2, JIT_R2);
+        jit_andi(JIT_R2, JIT_R2,
+                 int(unsigned(t.values[i + 1]) - unsigned(t.values[i])));
+      }
+      jit_addr(JIT_R1, JIT_R1, JIT_R2);
+    }
+    jit_movr(JIT_R0, JIT_R1);
+    return;
+  }
+
+  jit_movi(JIT_R2, (jit_word_t)t.edges.data());
+  for (size_t len = n; len > 1; len -= len / 2) {
+    size_t half = len / 2;
+    jit_ldxi_i(JIT_R1, JIT_R2, half * sizeof(int));
+    jit_ler(JIT_R1, JIT_R1, JIT_R0);
+    jit_muli(JIT_R1, JIT_R1, half * sizeof(int));
+    jit_addr(JIT_R2, JIT_R2, JIT_R1);
+  }
+  jit_ldxi_i(JIT_R1, JIT_R2, 0);
+  jit_ler(JIT_R1, JIT_R1, JIT_R0);
+  jit_subi(JIT_R2, JIT_R2, (jit_word_t)t.edges.data());
+  jit_rshi(JIT_R2, JIT_R2, 2);
+  jit_addr(JIT_R0, JIT_R2, JIT_R1);
+  if (piecewise) {
+    jit_movi(JIT_R1, (jit_word_t)t.values.data());
+    jit_lshi(JIT_R0, JIT_R0, 2);
+    jit_ldxr_i(JIT_R0, JIT_R1, JIT_R0);
+  }
+}
+
+// Frame slots a kernel has besides its rpn stack: the temps behind the
+// tee#k and tmp#k words, and for each vectorised call site c the block of
+// results vec#c reads, indexed by the row's offset in the current block.
+struct KernelFrame {
+  int temps = 0;
+  vector<int> results;
+  int block = 0; // first row of the current block
+  // column k's current value when it is delta packed, else -1
+  vector<int> running;
+};
+
+// reg = frame offset of element V2 - block of the int buffer at offset
+void emit_block_offset(int reg, int offset, const KernelFrame &frame) {
+  jit_ldxi_i(reg, JIT_FP, frame.block);
+  jit_subr(reg, JIT_V2, reg);
+  jit_lshi(reg, reg, 2);
+  jit_addi(reg, reg, offset);
+}
+
+// Code of compiled formula fragments, see FragmentCache; the word frag#k
+// calls fragment k on the kernel's bases and row. The slots of freed
+// fragments are reused.
+typedef int (*pfrag)(const void *const *bases, long row);
+static vector<pfrag> fragment_code;
+static vector<int> free_fragments;
+static mutex fragment_code_mu;
+
+int add_fragment(pfrag code) {
+  lock_guard<mutex> lock(fragment_code_mu);
+  if (free_fragments.empty()) {
+    fragment_code.push_back(code);
+    return fragment_code.size() - 1;
+  }
+  int k = free_fragments.back();
+  free_fragments.pop_back();
+  fragment_code[k] = code;
+  return k;
+}
+
+void remove_fragment(int k) {
+  lock_guard<mutex> lock(fragment_code_mu);
+  fragment_code.at(k) = nullptr;
+  free_fragments.push_back(k);
+}
+
+pfrag fragment(int k) {
+  lock_guard<mutex> lock(fragment_code_mu);
+  return fragment_code.at(k);
+}
+
+// a direct native call; the last argument is in R0, the others on the
+// frame stack. R0-R2 do not survive it, the kernel's V registers do.
+void emit_call(const HostFunction &f, int *sp) {
+  if (f.arity == 0)
+    stack_push(JIT_R0, sp);
+  jit_prepare();
+  for (int i = 1; i < f.arity; ++i) {
+    jit_ldxi_i(JIT_R1, JIT_FP, *sp - (f.arity - i) * sizeof(int));
+    jit_pushargr(JIT_R1);
+  }
+  if (f.arity > 0)
+    jit_pushargr(JIT_R0);
+  jit_finishi(f.fn);
+  jit_retval_i(JIT_R0);
+  *sp -= max(f.arity - 1, 0) * sizeof(int);
+}
+
+// one more run of an arm of '?' number k, in an instrumented compile
+void emit_branch_count(int k, bool taken) {
+  if (k >= (int)branch_counters.size())
+    return;
+  Profile::Branch *b = branch_counters[k];
+  jit_movi(JIT_R1, (jit_word_t)(taken ? &b->taken : &b->not_taken));
+  jit_ldxi(JIT_R2, JIT_R1, 0);
+  jit_addi(JIT_R2, JIT_R2, 1);
+  jit_stxi(0, JIT_R1, JIT_R2);
+}
+
+void emit_rpn(const char *expr, int *sp, const vector<Column> &columns,
+              const KernelFrame &frame = {}) {
+  // name -> symbol id and column index (or -1), so the symbol table is
+  // consulted once per distinct name rather than at every occurrence
+  struct Name {
+    int sym, k;
+  };
+  unordered_map<string_view, Name> names;
+  // open '?'s: the jump past the first arm, then the one past the second,
+  // and the stack depth each arm starts at
+  struct Branch {
+    jit_node_t *jump;
+    int sp;
+    bool unless;
+  };
+  unordered_map<int, Branch> branches;
+  // open loops: i's slot (followed by the bound's and LOOP_LANES
+  // accumulators'), and the jump to the trip test and the body it repeats
+  struct Loop {
+    int base;
+    bool product;
+    jit_node_t *test, *body;
+  };
+  unordered_map<int, Loop> loops;
+
+  bool canonical = true;
+  while (*expr) {
+    char buf[32];
+    int n;
+    if (sscanf(expr, "%[0-9]%n", buf, &n)) {
+      // a constant right operand folds into the operator that follows
+      const char *next = expr + n + (expr[n] == ' ');
+      int len = rpn_op_len(next);
+      if (len && (next[len] == ' ' || !next[len]) &&
+          emit_binary_imm(string_view(next, len), atoi(buf), canonical)) {
+        expr = next + len - 1;
+        canonical = false;
+      } else {
+        expr += n - 1;
+        stack_push(JIT_R0, sp);
+        jit_movi(JIT_R0, atoi(buf));
+        canonical = true;
+      }
+    } else if (isalpha(*expr) || *expr == '_') {
+      n = 1;
+      while (isalnum(expr[n]) || expr[n] == '_')
+        ++n;
+      if (expr[n] == '#') {
+        string_view word(expr, n);
+        int index = atoi(expr + n + 1);
+        if (word == "tmp" || word == "vec" || word == "frag" ||
+            word == "idx") {
+          stack_push(JIT_R0, sp);
+          if (word == "tmp") {
+            jit_ldxi_i(JIT_R0, JIT_FP, frame.temps + index * sizeof(int));
+          } else if (word == "idx") {
+            jit_ldxi_i(JIT_R0, JIT_FP, loops.at(index).base);
+          } else if (word == "frag") {
+            jit_prepare();
+            jit_pushargr(JIT_V0);
+            jit_pushargr(JIT_V2);
+            jit_finishi((void *)fragment(index));
+            jit_retval_i(JIT_R0);
+          } else {
+            emit_block_offset(JIT_R1, frame.results[index], frame);
+            jit_ldxr_i(JIT_R0, JIT_FP, JIT_R1);
+          }
+          canonical = true;
+        } else if (word == "tee") {
+          jit_stxi_i(frame.temps + index * sizeof(int), JIT_FP, JIT_R0);
+        } else if (word == "if" || word == "unless") {
+          // the condition is tested as the int it stands for
+          if (canonical)
+            jit_movr(JIT_R2, JIT_R0);
+          else
+            jit_extr_i(JIT_R2, JIT_R0);
+          stack_pop(JIT_R0, sp);
+          bool unless = word == "unless";
+          branches[index] = {unless ? jit_bnei(JIT_R2, 0)
+                                    : jit_beqi(JIT_R2, 0),
+                             *sp, unless};
+          emit_branch_count(index, !unless);
+          canonical = true;
+        } else if (word == "else") {
+          Branch &b = branches.at(index);
+          jit_node_t *join = jit_jmpi();
+          jit_patch(b.jump);
+          b.jump = join;
+          *sp = b.sp;
+          emit_branch_count(index, b.unless);
+          canonical = true;
+        } else if (word == "fi") {
+          jit_patch(branches.at(index).jump);
+          branches.erase(index);
+          canonical = false;
+        } else if (word == "sum" || word == "prod") {
+          // i starts in lo's slot; hi and the accumulators go above it
+          Loop &loop = loops[index] = {*sp - int(sizeof(int)),
+                                       word == "prod", nullptr, nullptr};
+          stack_push(JIT_R0, sp);
+          jit_movi(JIT_R0, loop.product);
+          for (int lane = 0; lane < LOOP_LANES; ++lane)
+            stack_push(JIT_R0, sp);
+          loop.test = jit_jmpi();
+          loop.body = jit_label();
+        } else if (word == "next" || word == "end") {
+          // one value per lane: the last in R0, the others on the stack
+          // above the slot the first body pushed on entry
+          Loop &loop = loops.at(index);
+          int acc = loop.base + 2 * sizeof(int);
+          int top = acc + LOOP_LANES * sizeof(int);
+          int lanes = (*sp - top) / sizeof(int);
+          for (int lane = lanes - 1; lane >= 0; --lane) {
+            if (lane < lanes - 1)
+              stack_pop(JIT_R0, sp);
+            jit_ldxi_i(JIT_R1, JIT_FP, acc + lane * sizeof(int));
+            if (loop.product)
+              jit_mulr(JIT_R1, JIT_R1, JIT_R0);
+            else
+              jit_addr(JIT_R1, JIT_R1, JIT_R0);
+            jit_stxi_i(acc + lane * sizeof(int), JIT_FP, JIT_R1);
+          }
+          *sp = top;
+          jit_ldxi_i(JIT_R1, JIT_FP, loop.base);
+          jit_addi(JIT_R1, JIT_R1, lanes);
+          jit_stxi_i(loop.base, JIT_FP, JIT_R1);
+          // another trip while all lanes fit below hi
+          jit_patch(loop.test);
+          jit_ldxi_i(JIT_R1, JIT_FP, loop.base);
+          jit_addi(JIT_R1, JIT_R1, lanes);
+          jit_ldxi_i(JIT_R2, JIT_FP, loop.base + sizeof(int));
+          jit_patch_at(jit_bler(JIT_R1, JIT_R2), loop.body);
+          if (word == "next") {
+            loop.test = jit_jmpi();
+            loop.body = jit_label();
+          } else {
+            jit_ldxi_i(JIT_R0, JIT_FP, acc);
+            for (int lane = 1; lane < LOOP_LANES; ++lane) {
+              jit_ldxi_i(JIT_R1, JIT_FP, acc + lane * sizeof(int));
+              if (loop.product)
+                jit_mulr(JIT_R0, JIT_R0, JIT_R1);
+              else
+                jit_addr(JIT_R0, JIT_R0, JIT_R1);
+            }
+            *sp = loop.base;
+            loops.erase(index);
+            canonical = false;
+          }
+        } else if (word == "bucket" || word == "piecewise" ||
+                   word == "tabulate") {
+          emit_lookup(word, index, canonical);
+          canonical = word != "piecewise"; // small piecewise sums may wrap
+        } else {
+          fprintf(stderr, "cannot compile: %.*s#\n", n, expr);
+          abort();
+        }
+        while (isdigit(expr[n + 1]))
+          ++n;
+        expr += n + 1;
+        continue;
+      }
+      auto [it, fresh] = names.try_emplace(string_view(expr, n), Name{-1, -1});
+      Name &name = it->second;
+      if (fresh) {
+        name.sym = symbols.find(it->first);
+        for (size_t c = 0; c < columns.size(); ++c)
+          if (name.sym >= 0 && columns[c].sym == name.sym)
+            name.k = c;
+      }
+      int sym = name.sym, k = name.k;
+      if (const HostFunction *f = k < 0 ? host_function(sym) : nullptr) {
+        emit_call(*f, sp);
+        canonical = true;
+        expr += n;
+        continue;
+      }
+      if (k < 0) {
+        fprintf(stderr, "cannot compile: unbound variable %.*s\n", n, expr);
+        abort();
+      }
+      // name@k is element k of a vector or matrix column
+      int element = 0, size = columns[k].rows * columns[k].cols *
+                                (columns[k].complex ? 2 : 1);
+      // and name[] the element the index in R0 picks
+      if (expr[n] == '[' && expr[n + 1] == ']' && !columns[k].samples &&
+          !columns[k].complex && !columns[k].bits) {
+        if (!canonical)
+          jit_extr_i(JIT_R0, JIT_R0);
+        emit_indexed_load(k, columns[k], size);
+        canonical = true;
+        expr += n + 2;
+        continue;
+      }
+      bool indexed = expr[n] == '@';
+      if (indexed) {
+        element = atoi(expr + n + 1);
+        while (isdigit(expr[n + 1]))
+          ++n;
+        ++n;
+      }
+      if ((size > 1 && !indexed) || element >= size) {
+        fprintf(stderr, "cannot compile: bad use of %s\n",
+                columns[k].name.c_str());
+        abort();
+      }
+      expr += n - 1;
+      stack_push(JIT_R0, sp);
+      if (columns[k].delta)
+        jit_ldxi_i(JIT_R0, JIT_FP, frame.running[k]);
+      else
+        emit_load(k, columns[k], element);
+      canonical = true;
+    } else if (*expr == '~') {
+      jit_comr(JIT_R0, JIT_R0);
+    } else if (!strncmp(expr, "--", 2)) {
+      jit_negr(JIT_R0, JIT_R0);
+      ++expr;
+      canonical = false;
+    } else if (int len = rpn_op_len(expr)) {
+      stack_pop(JIT_R1, sp);
+      emit_binary(string_view(expr, len), canonical);
+      expr += len - 1;
+      canonical = false;
+    } else if (*expr == '(' || *expr == ')' || *expr == ' ') {
+      ++expr;
+      continue;
+    } else {
+      fprintf(stderr, "cannot compile: %s\n", expr);
+      abort();
+    }
+    ++expr;
+  }
+}
+
+// How a kernel calls host functions: pure calls on constants run once
+// before the row loop, a pure call made more than once per row runs once,
+// and functions with a vectorised variant run once per block of rows.
+struct CallPlan {
+  struct Site {
+    const HostFunction *fn;
+    vector<string> args; // rpn of each argument
+  };
+  vector<string> hoisted; // sets temp reserved + k before the loop
+  vector<Site> sites;     // read back by vec#c
+  string body;
+  int reserved = 0; // temps the rpn's own tee#k words use
+  int temps = 0;
+};
+
+const int HOST_BLOCK = 64;
+
+class CallPlanner {
+public:
+  explicit CallPlanner(const vector<Column> &columns) : columns(columns) {}
+
+  CallPlan plan(const string &rpn, bool batch) {
+    CallPlan plan;
+    plan.body = rpn;
+    for (size_t at = rpn.find("tee#"); at != string::npos;
+         at = rpn.find("tee#", at + 4))
+      plan.reserved = max(plan.reserved, atoi(rpn.c_str() + at + 4) + 1);
+    plan.temps = plan.reserved;
+    if (!parse(rpn))
+      return plan;
+    if (batch) {
+      for (int root : roots)
+        hoist(root, plan);
+      for (int root : roots)
+        vectorise(root, plan);
+    }
+    plan.temps = plan.reserved + plan.hoisted.size();
+    unordered_map<string, int> seen;
+    for (int root : roots)
+      count(root, seen);
+    for (int root : roots)
+      share(root, seen, plan);
+    plan.body.clear();
+    for (int root : roots)
+      plan.body += (plan.body.empty() ? "" : " ") + text(root);
+    return plan;
+  }
+
+private:
+  struct Node {
+    string word;
+    vector<int> kids;
+    const HostFunction *fn = nullptr;
+  };
+  const vector<Column> &columns;
+  vector<Node> nodes;
+  vector<int> roots;
+
+  bool is_column(string_view word) {
+    int sym = symbols.find(word.substr(0, word.find('@')));
+    for (const auto &col : columns)
+      if (col.sym == sym)
+        return true;
+    return false;
+  }
+
+  // the rpn as trees; false when there are no calls or an unknown word
+  bool parse(const string &rpn) {
+    bool calls = false;
+    istringstream iss(rpn);
+    string word;
+    while (iss >> word) {
+      Node node{word, {}, nullptr};
+      size_t arity = 0;
+      if (isdigit(word[0])) {
+      } else if (is_identifier(word) && word.find('#') != string::npos) {
+        string_view base = string_view(word).substr(0, word.find('#'));
+        // calls are not planned across the arms of a '?' or into loops
+        if (base == "if" || base == "unless" || base == "else" ||
+            base == "fi" || base == "sum" || base == "prod" ||
+            base == "next" || base == "end" || base == "idx")
+          return false;
+        arity = base == "tmp" || base == "vec" || base == "frag" ? 0 : 1;
+      } else if (is_identifier(word) && word.back() == ']') {
+        arity = 1;
+      } else if (is_identifier(word) && !is_column(word) &&
+                 (node.fn = host_function(symbols.find(word)))) {
+        arity = node.fn->arity;
+        calls = true;
+      } else if (is_identifier(word)) {
+      } else if (word == "~" || word == "--") {
+        arity = 1;
+      } else if (rpn_op_len(word.c_str()) == (int)word.size()) {
+        arity = 2;
+      } else {
+        return false;
+      }
+      if (roots.size() < arity)
+        return false;
+      node.kids.assign(roots.end() - arity, roots.end());
+      roots.resize(roots.size() - arity);
+      roots.push_back(nodes.size());
+      nodes.push_back(std::move(node));
+    }
+    return calls;
+  }
+
+  string text(int i) {
+    string t;
+    for (int kid : nodes[i].kids)
+      t += text(kid) + " ";
+    return t + nodes[i].word;
+  }
+
+  bool invariant(int i) {
+    const Node &node = nodes[i];
+    if (node.kids.empty() && !node.fn)
+      return isdigit(node.word[0]);
+    if (node.fn && !node.fn->pure())
+      return false;
+    for (int kid : node.kids)
+      if (!invariant(kid))
+        return false;
+    return true;
+  }
+
+  bool has_call(int i) {
+    if (nodes[i].fn)
+      return true;
+    for (int kid : nodes[i].kids)
+      if (has_call(kid))
+        return true;
+    return false;
+  }
+
+  static int index_of(vector<string> &keys, const string &key) {
+    auto it = find(keys.begin(), keys.end(), key);
+    if (it == keys.end())
+      it = keys.insert(it, key);
+    return it - keys.begin();
+  }
+
+  void hoist(int i, CallPlan &plan) {
+    if (has_call(i) && invariant(i)) {
+      nodes[i] = {"tmp#" + std::to_string(plan.reserved +
+                                          index_of(plan.hoisted, text(i))),
+                  {},
+                  nullptr};
+      return;
+    }
+    for (int kid : nodes[i].kids)
+      hoist(kid, plan);
+  }
+
+  // inner sites first, so an outer site's arguments can read them
+  void vectorise(int i, CallPlan &plan) {
+    for (int kid : nodes[i].kids)
+      vectorise(kid, plan);
+    // each impure call must run, so only pure ones share a site
+    if (!nodes[i].fn || !nodes[i].fn->vectorised || !nodes[i].fn->pure())
+      return;
+    CallPlan::Site site{nodes[i].fn, {}};
+    for (int kid : nodes[i].kids)
+      site.args.push_back(text(kid));
+    size_t c = 0;
+    while (c < plan.sites.size() && (plan.sites[c].fn != site.fn ||
+                                     plan.sites[c].args != site.args))
+      ++c;
+    if (c == plan.sites.size())
+      plan.sites.push_back(site);
+    nodes[i] = {"vec#" + std::to_string(c), {}, nullptr};
+  }
+
+  bool shareable(int i) {
+    const HostFunction *f = nodes[i].fn;
+    return f && f->pure() && !(f->attrs & HOST_CHEAP);
+  }
+
+  void count(int i, unordered_map<string, int> &seen) {
+    if (shareable(i))
+      ++seen[text(i)];
+    for (int kid : nodes[i].kids)
+      count(kid, seen);
+  }
+
+  // equal calls never nest, so the first one met here is the first one
+  // the kernel evaluates
+  void share(int i, unordered_map<string, int> &seen, CallPlan &plan) {
+    if (shareable(i)) {
+      int &n = seen[text(i)];
+      if (n < 0) {
+        nodes[i] = {"tmp#" + std::to_string(-n - 1), {}, nullptr};
+        return;
+      }
+      if (n > 1) {
+        n = -1 - plan.temps++;
+        nodes.push_back(nodes[i]);
+        nodes[i] = {"tee#" + std::to_string(-n - 1), {int(nodes.size() - 1)}};
+        i = nodes.size() - 1;
+      }
+    }
+    for (int kid : vector<int>(nodes[i].kids))
+      share(kid, seen, plan);
+  }
+};
+
+jit_node_t *compile_rpn(const char *expr) {
+  jit_node_t *in, *fn;
+  int stack_base, stack_ptr;
+  CallPlan plan = CallPlanner({}).plan(expr, false);
+  KernelFrame frame;
+
+  fn = jit_note(NULL, 0);
+  jit_prolog();
+  in = jit_arg();
+  stack_ptr = stack_base = jit_allocai(rpn_stack_slots(expr) * sizeof(int));
+  frame.temps = jit_allocai(max(plan.temps, 1) * sizeof(int));
+
+  jit_getarg(JIT_R2, in);
+
+  emit_rpn(plan.body.c_str(), &stack_ptr, {}, frame);
+  jit_retr(JIT_R0);
+  jit_epilog();
+  return fn;
+}
+
+// a frag#k callee: expr on row V2 of the columns at V0, both passed in by
+// the calling kernel
+jit_node_t *compile_fragment(const char *expr, const vector<Column> &columns) {
+  jit_node_t *bases, *row, *fn;
+  int stack_ptr;
+
+  fn = jit_note(NULL, 0);
+  jit_prolog();
+  bases = jit_arg();
+  row = jit_arg();
+  stack_ptr = jit_allocai(rpn_stack_slots(expr) * sizeof(int));
+
+  jit_getarg(JIT_V0, bases);
+  jit_getarg(JIT_V2, row);
+
+  emit_rpn(expr, &stack_ptr, columns);
+  jit_retr(JIT_R0);
+  jit_epilog();
+  return fn;
+}
+
+// one vectorised call for the rows [block, end): its arguments are
+// evaluated row by row into frame buffers first
+void emit_site(const CallPlan::Site &site, int args, int argv, int result,
+               int end, int stack_ptr, const vector<Column> &columns,
+               const KernelFrame &frame) {
+  int arity = site.args.size();
+  if (arity > 0) {
+    jit_ldxi_i(JIT_V2, JIT_FP, frame.block);
+    jit_node_t *loop = jit_label();
+    jit_ldxi_i(JIT_R1, JIT_FP, end);
+    jit_node_t *done = jit_bger(JIT_V2, JIT_R1);
+    for (int j = 0; j < arity; ++j) {
+      int sp = stack_ptr;
+      emit_rpn(site.args[j].c_str(), &sp, columns, frame);
+      emit_block_offset(JIT_R1, args + j * HOST_BLOCK * sizeof(int), frame);
+      jit_stxr_i(JIT_R1, JIT_FP, JIT_R0);
+    }
+    jit_addi(JIT_V2, JIT_V2, 1);
+    jit_patch_at(jit_jmpi(), loop);
+    jit_patch(done);
+  }
+  for (int j = 0; j < arity; ++j) {
+    jit_addi(JIT_R0, JIT_FP, args + j * HOST_BLOCK * sizeof(int));
+    jit_stxi(argv + j * sizeof(void *), JIT_FP, JIT_R0);
+  }
+  jit_ldxi_i(JIT_R2, JIT_FP, end);
+  jit_ldxi_i(JIT_R1, JIT_FP, frame.block);
+  jit_subr(JIT_R2, JIT_R2, JIT_R1);
+  jit_addi(JIT_R0, JIT_FP, argv);
+  jit_addi(JIT_R1, JIT_FP, result);
+  jit_prepare();
+  jit_pushargr(JIT_R0);
+  jit_pushargr(JIT_R1);
+  jit_pushargr(JIT_R2);
+  jit_finishi((void *)site.fn->vectorised);
+}
+
+// out[i] = expr evaluated on row i, loading each variable straight from its
+// strided column so array-of-structs input never has to be repacked. With
+// width > 1 expr is a sequence and row i writes out[i * width + j]. Rows
+// go in blocks of HOST_BLOCK when vectorised host functions are called.
+// Packed columns are decoded row by row as they are loaded; a delta packed
+// one is advanced once at the top of each row.
+jit_node_t *compile_batch(const char *expr, const vector<Column> &columns,
+                          int width = 1) {
+  jit_node_t *bases, *out, *n, *fn, *outer, *loop, *next, *done;
+  int stack_ptr, n_off, end_off;
+  CallPlan plan = CallPlanner(columns).plan(expr, true);
+  KernelFrame frame;
+  vector<int> args, argv;
+
+  fn = jit_note(NULL, 0);
+  jit_prolog();
+  bases = jit_arg();
+  out = jit_arg();
+  n = jit_arg();
+  n_off = jit_allocai(sizeof(int));
+  stack_ptr = jit_allocai(rpn_stack_slots(expr) * sizeof(int));
+  frame.temps = jit_allocai(max(plan.temps, 1) * sizeof(int));
+  frame.block = jit_allocai(sizeof(int));
+  end_off = plan.sites.empty() ? n_off : jit_allocai(sizeof(int));
+  frame.running.assign(columns.size(), -1);
+  for (size_t k = 0; k < columns.size(); ++k)
+    if (columns[k].delta) {
+      if (!plan.sites.empty())
+        throw runtime_error("vectorised calls cannot read delta packed " +
+                            columns[k].name);
+      frame.running[k] = jit_allocai(sizeof(int));
+    }
+  for (const auto &site : plan.sites) {
+    int arity = max<int>(site.args.size(), 1);
+    frame.results.push_back(jit_allocai(HOST_BLOCK * sizeof(int)));
+    args.push_back(jit_allocai(arity * HOST_BLOCK * sizeof(int)));
+    argv.push_back(jit_allocai(arity * sizeof(void *)));
+  }
+
+  jit_getarg(JIT_V0, bases);
+  jit_getarg(JIT_V1, out);
+  jit_getarg_i(JIT_R0, n);
+  jit_stxi_i(n_off, JIT_FP, JIT_R0);
+  jit_movi(JIT_V2, 0);
+  for (size_t k = 0; k < columns.size(); ++k)
+    if (frame.running[k] >= 0) {
+      jit_movi(JIT_R0, columns[k].start);
+      jit_stxi_i(frame.running[k], JIT_FP, JIT_R0);
+    }
+  for (size_t k = 0; k < plan.hoisted.size(); ++k) {
+    int sp = stack_ptr;
+    emit_rpn(plan.hoisted[k].c_str(), &sp, columns, frame);
+    jit_stxi_i(frame.temps + (plan.reserved + k) * sizeof(int), JIT_FP,
+               JIT_R0);
+  }
+
+  outer = jit_label();
+  jit_ldxi_i(JIT_R1, JIT_FP, n_off);
+  done = jit_bger(JIT_V2, JIT_R1);
+  if (!plan.sites.empty()) {
+    jit_stxi_i(frame.block, JIT_FP, JIT_V2);
+    jit_addi(JIT_R0, JIT_V2, HOST_BLOCK);
+    jit_node_t *last = jit_bger(JIT_R0, JIT_R1);
+    jit_movr(JIT_R1, JIT_R0);
+    jit_patch(last);
+    jit_stxi_i(end_off, JIT_FP, JIT_R1);
+    for (size_t c = 0; c < plan.sites.size(); ++c)
+      emit_site(plan.sites[c], args[c], argv[c], frame.results[c], end_off,
+                stack_ptr, columns, frame);
+    jit_ldxi_i(JIT_V2, JIT_FP, frame.block);
+  }
+
+  loop = jit_label();
+  jit_ldxi_i(JIT_R1, JIT_FP, end_off);
+  next = jit_bger(JIT_V2, JIT_R1);
+  for (size_t k = 0; k < columns.size(); ++k)
+    if (frame.running[k] >= 0) {
+      emit_unpack(k, columns[k]);
+      jit_ldxi_i(JIT_R1, JIT_FP, frame.running[k]);
+      jit_addr(JIT_R0, JIT_R0, JIT_R1);
+      jit_stxi_i(frame.running[k], JIT_FP, JIT_R0);
+    }
+  emit_rpn(plan.body.c_str(), &stack_ptr, columns, frame);
+  if ((width & (width - 1)) == 0)
+    jit_lshi(JIT_R1, JIT_V2, __builtin_ctz(width * sizeof(int)));
+  else
+    jit_muli(JIT_R1, JIT_V2, width * sizeof(int));
+  jit_addr(JIT_R1, JIT_R1, JIT_V1);
+  for (int j = width - 1; j >= 0; --j) {
+    jit_stxi_i(j * sizeof(int), JIT_R1, JIT_R0);
+    if (j)
+      stack_pop(JIT_R0, &stack_ptr);
+  }
+  jit_addi(JIT_V2, JIT_V2, 1);
+  jit_patch_at(jit_jmpi(), loop);
+  jit_patch(next);
+  jit_patch_at(jit_jmpi(), outer);
+  jit_patch(done);
+  jit_ret();
+  jit_epilog();
+  return fn;
+}
+
+pifv eval(const string line) {
+  _jit = jit_new_state();
+  auto c_expr = compile_rpn(line.c_str());
+  (void)jit_emit();
+  auto eval = (pifv)jit_address(c_expr);
+  jit_word_t bytes;
+  jit_get_code(&bytes);
+  code_bytes += bytes;
+  jit_clear_state();
+  return eval;
+}
+
+pbatch eval_batch(const string line, const vector<Column> &columns,
+                  int width = 1) {
+  _jit = jit_new_state();
+  auto c_expr = compile_batch(line.c_str(), columns, width);
+  (void)jit_emit();
+  auto eval = (pbatch)jit_address(c_expr);
+  jit_word_t bytes;
+  jit_get_code(&bytes);
+  code_bytes += bytes;
+  jit_clear_state();
+  return eval;
+}
+
+// vector and matrix operations are checked and unrolled first, then the
+// passes of level run; *width receives the number of ints each row writes
+pbatch eval_batch(const shared_ptr<S> &e, const vector<Column> &columns,
+                  int *width, int level = opt_level) {
+  auto scalar = lower_branches(
+      lower_shapes(lower_comprehensions(lower_tables(e)), columns, width));
+  return eval_batch(passes().run(scalar, level)->to_string(), columns,
+                    *width);
+}
+
+// Prebuilt kernels for the common tree shapes. A shape is a tree of + - * /
+// over at most SHAPE_LEAVES leaves, each a variable or a constant: a * b + c
+// and x * y + z are both "v v * v +", and x * 3 is "v c *". Every shape of
+// one or two operators is instantiated from templates when this file is
+// compiled; a tree that matches one runs it with its columns and constants
+// bound as arguments, so nothing is generated at run time.
+const int SHAPE_LEAVES = 3;
+
+struct ShapeArgs {
+  const char *p[SHAPE_LEAVES]; // variable leaves: the row 0 element
+  long stride[SHAPE_LEAVES];
+  int constant[SHAPE_LEAVES];
+};
+
+// where variable leaf s is found relative to bases, bound per call
+struct ShapeBinding {
+  int column[SHAPE_LEAVES];
+  long stride[SHAPE_LEAVES], offset[SHAPE_LEAVES];
+  int constant[SHAPE_LEAVES];
+};
+
+struct ShapeVar {
+  static const int leaves = 1;
+  static string key() { return "v"; }
+  template <int L> static int at(const ShapeArgs &a, long i) {
+    return *(const int *)(a.p[L] + i * a.stride[L]);
+  }
+};
+
+struct ShapeConst {
+  static const int leaves = 1;
+  static string key() { return "c"; }
+  template <int L> static int at(const ShapeArgs &a, long) {
+    return a.constant[L];
+  }
+};
+
+// every result wraps to an int, like the generated code's; / traps on
+// zero the same way, and INT_MIN / -1 wraps rather than trapping
+template <char Op> int shape_op(int a, int b) {
+  if constexpr (Op == '+')
+    return unsigned(a) + unsigned(b);
+  else if constexpr (Op == '-')
+    return unsigned(a) - unsigned(b);
+  else if constexpr (Op == '*')
+    return unsigned(a) * unsigned(b);
+  else
+    return int64_t(a) / b;
+}
+
+template <char Op, typename A, typename B> struct ShapeOp {
+  static const int leaves = A::leaves + B::leaves;
+  static string key() { return A::key() + " " + B::key() + " " + Op; }
+  template <int L> static int at(const ShapeArgs &a, long i) {
+    return shape_op<Op>(A::template at<L>(a, i),
+                        B::template at<L + A::leaves>(a, i));
+  }
+};
+
+typedef void (*shape_fn)(const ShapeBinding &, const void *const *, int *,
+                         int);
+
+template <typename E>
+void shape_kernel(const ShapeBinding &binding, const void *const *bases,
+                  int *out, int n) {
+  // a local copy, so the compiler knows stores to out leave it alone
+  ShapeArgs a;
+  for (int l = 0; l < E::leaves; ++l) {
+    a.p[l] = binding.column[l] < 0
+                 ? nullptr
+                 : (const char *)bases[binding.column[l]] + binding.offset[l];
+    a.stride[l] = binding.stride[l];
+    a.constant[l] = binding.constant[l];
+  }
+  for (int i = 0; i < n; ++i)
+    out[i] = E::template at<0>(a, i);
+}
+
+template <char... Ops> struct ShapeLibrary {
+  typedef unordered_map<string, shape_fn> Map;
+
+  template <typename E> static void add(Map &m) {
+    m.emplace(E::key(), shape_kernel<E>);
+  }
+  template <typename A, typename B> static void pairs(Map &m) {
+    (add<ShapeOp<Ops, A, B>>(m), ...);
+  }
+  // (a op b) op c and a op (b op c) for every pair of operators
+  template <typename A, typename B, typename C> static void triples(Map &m) {
+    (pairs<ShapeOp<Ops, A, B>, C>(m), ...);
+    (pairs<A, ShapeOp<Ops, B, C>>(m), ...);
+  }
+
+  static Map build() {
+    typedef ShapeVar V;
+    typedef ShapeConst C;
+    Map m;
+    add<V>(m);
+    pairs<V, V>(m), pairs<V, C>(m), pairs<C, V>(m);
+    triples<V, V, V>(m), triples<V, V, C>(m), triples<V, C, V>(m);
+    triples<C, V, V>(m), triples<V, C, C>(m), triples<C, V, C>(m);
+    triples<C, C, V>(m);
+    return m;
+  }
+};
+
+const unordered_map<string, shape_fn> &shape_library() {
+  static const auto library = ShapeLibrary<'+', '-', '*', '/'>::build();
+  return library;
+}
+
+// appends e's shape to key and binds its leaves; false when e has none
+bool shape_of(const S &e, const vector<Column> &columns, string &key,
+              ShapeBinding &binding, int &leaves) {
+  if (e.rest.empty()) {
+    if (leaves == SHAPE_LEAVES)
+      return false;
+    uint32_t value;
+    int l = leaves++;
+    binding.column[l] = -1;
+    binding.stride[l] = binding.offset[l] = binding.constant[l] = 0;
+    if (int_literal(e, &value)) {
+      binding.constant[l] = value;
+      key += key.empty() ? "c" : " c";
+      return true;
+    }
+    for (size_t k = 0; k < columns.size(); ++k)
+      if (columns[k].sym == e.sym && e.sym >= 0) {
+        const Column &col = columns[k];
+        if (col.samples || col.complex || col.bits ||
+            col.rows * col.cols != 1)
+          return false;
+        binding.column[l] = k;
+        binding.stride[l] = col.stride;
+        binding.offset[l] = col.offset;
+        key += key.empty() ? "v" : " v";
+        return true;
+      }
+    return false;
+  }
+  if (e.rest.size() != 2 || e.head.size() != 1 || !strchr("+-*/", e.head[0]))
+    return false;
+  if (!shape_of(*e.rest[0], columns, key, binding, leaves) ||
+      !shape_of(*e.rest[1], columns, key, binding, leaves))
+    return false;
+  key += " " + e.head;
+  return true;
+}
+
+struct ShapeStats {
+  size_t hits = 0, misses = 0;
+};
+
+// a batch kernel that is either prebuilt for e's shape or compiled
+struct BatchKernel {
+  shape_fn shape = nullptr;
+  ShapeBinding binding;
+  pbatch compiled = nullptr;
+
+  void operator()(const void *const *bases, int *out, int n) const {
+    if (shape)
+      shape(binding, bases, out, n);
+    else
+      compiled(bases, out, n);
+  }
+};
+
+BatchKernel batch_kernel(const shared_ptr<S> &e, const vector<Column> &columns,
+                         ShapeStats *stats = nullptr) {
+  BatchKernel kernel;
+  auto canonical = canonicalize(e);
+  string key;
+  int leaves = 0;
+  if (shape_of(*canonical, columns, key, kernel.binding, leaves)) {
+    auto it = shape_library().find(key);
+    if (it != shape_library().end())
+      kernel.shape = it->second;
+  }
+  if (stats)
+    ++(kernel.shape ? stats->hits : stats->misses);
+  if (!kernel.shape) {
+    int width;
+    kernel.compiled = eval_batch(e, columns, &width);
+    if (width != 1)
+      throw runtime_error("batch_kernel() takes scalar expressions");
+  }
+  return kernel;
+}
+
+struct GridAxis {
+  string name;
+  int lo, hi, samples;
+};
+
+// f sampled on a regular grid with no input arrays: axes[0] varies
+// fastest, so out[i0 + axes[0].samples * (i1 + ...)] is f at sample i0 of
+// axes[0], i1 of axes[1] and so on. The kernel generates the coordinates
+// from its row index; threads split the grid by rows along axes[0].
+vector<int> eval_grid(const shared_ptr<S> &e, const vector<GridAxis> &axes,
+                      unsigned threads = 0) {
+  if (axes.empty())
+    throw runtime_error("eval_grid() needs an axis");
+  size_t total = 1;
+  vector<Column> columns;
+  for (size_t k = 0; k < axes.size(); ++k) {
+    const GridAxis &a = axes[k];
+    if (a.samples < 1 || a.samples > 65536)
+      throw runtime_error("grid axis " + a.name + " needs 1 to 65536 samples");
+    Column col(a.name, k == 0, 0);
+    col.lo = a.lo, col.hi = a.hi, col.samples = a.samples;
+    columns.push_back(col);
+    total *= a.samples;
+  }
+  int width;
+  auto kernel = eval_batch(e, columns, &width);
+
+  vector<int> out(total * width);
+  size_t row = axes[0].samples, rows = total / row;
+  if (!threads)
+    threads = min<size_t>(max(1u, thread::hardware_concurrency()), rows);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+    workers.emplace_back([&, t] {
+      vector<int> index(axes.size());
+      vector<const void *> bases;
+      for (const int &i : index)
+        bases.push_back(&i);
+      for (size_t r = rows * t / threads; r < rows * (t + 1) / threads; ++r) {
+        size_t rest = r;
+        for (size_t k = 1; k < axes.size(); ++k) {
+          index[k] = rest % axes[k].samples;
+          rest /= axes[k].samples;
+        }
+        kernel(bases.data(), out.data() + r * row * width, row);
+      }
+    });
+  for (auto &w : workers)
+    w.join();
+  return out;
+}
+
+// Incremental recompilation of large formulas. Every subtree that grows
+// past FRAGMENT_NODES nodes becomes a function of its own, and its parent
+// calls it through a frag#k word with the row being evaluated. Fragments
+// are cached by their rpn, which already names the fragments below them,
+// so after an edit only the fragments on the path from the edit to the
+// root are generated again. A long left-leaning chain such as
+// a + b + c + ... is one path, so edits near its start still rebuild most
+// of it. The formula may read the scalar columns the cache was made for;
+// the kernel compile() returns runs over rows like eval_batch()'s and
+// stays valid until the next compile(). Past capacity entries the least
+// recently used rpns are forgotten, and a fragment's code is freed once
+// neither an entry, a live fragment nor the current kernel calls it.
+class FragmentCache {
+public:
+  static const int FRAGMENT_NODES = 64;
+
+  struct Stats {
+    size_t compiled = 0, reused = 0; // fragments, for the last compile()
+  };
+
+  explicit FragmentCache(vector<Column> columns = {},
+                         size_t capacity = 1 << 14)
+      : columns(std::move(columns)), capacity(capacity) {
+    for (const auto &col : this->columns)
+      if (col.delta || col.complex || col.rows * col.cols != 1)
+        throw runtime_error("fragments cannot read the column " + col.name);
+  }
+
+  FragmentCache(const FragmentCache &) = delete;
+  FragmentCache &operator=(const FragmentCache &) = delete;
+
+  ~FragmentCache() {
+    drop(current);
+    for (const auto &entry : cache)
+      release(entry.second.index);
+  }
+
+  pbatch compile(const shared_ptr<S> &e) {
+    stats = {};
+    ++clock;
+    int nodes;
+    string rpn = lower(*e, &nodes, true);
+    Code kernel{_jit = jit_new_state(), called(rpn), 1};
+    pbatch f = (pbatch)emit(compile_batch(rpn.c_str(), columns));
+    for (int k : kernel.calls)
+      ++code_of.at(k).refs;
+    drop(current);
+    current = kernel;
+    if (cache.size() > capacity)
+      evict();
+    return f;
+  }
+
+  const Stats &last() const { return stats; }
+  size_t size() const { return cache.size(); }
+  size_t live() const { return code_of.size(); } // fragments not yet freed
+
+private:
+  struct Entry {
+    int index; // into fragment_code
+    uint64_t used;
+  };
+  struct Code {
+    jit_state_t *state;
+    vector<int> calls; // the fragments it calls
+    int refs;          // its cache entry, callers and the current kernel
+  };
+  vector<Column> columns;
+  unordered_map<string, Entry> cache; // by rpn
+  unordered_map<int, Code> code_of;   // by fragment index
+  Code current{}; // of the kernel compile() last returned
+  size_t capacity;
+  uint64_t clock = 0; // compile() calls so far
+  Stats stats;
+
+  static vector<int> called(const string &rpn) {
+    vector<int> calls;
+    for (size_t at = rpn.find("frag#"); at != string::npos;
+         at = rpn.find("frag#", at + 5))
+      calls.push_back(atoi(rpn.c_str() + at + 5));
+    return calls;
+  }
+
+  // each function has a state of its own, so its code is freed alone
+  static void *emit(jit_node_t *fn) {
+    (void)jit_emit();
+    void *code = jit_address(fn);
+    jit_word_t bytes;
+    jit_get_code(&bytes);
+    code_bytes += bytes;
+    jit_clear_state();
+    return code;
+  }
+
+  void drop(const Code &kernel) {
+    if (!kernel.state)
+      return;
+    for (int k : kernel.calls)
+      release(k);
+    _jit = kernel.state;
+    jit_destroy_state();
+  }
+
+  void release(int index) {
+    auto it = code_of.find(index);
+    if (--it->second.refs > 0)
+      return;
+    for (int k : it->second.calls)
+      release(k);
+    _jit = it->second.state;
+    jit_destroy_state();
+    remove_fragment(index);
+    code_of.erase(it);
+  }
+
+  int code(const string &rpn) {
+    if (auto it = cache.find(rpn); it != cache.end()) {
+      ++stats.reused;
+      it->second.used = clock;
+      return it->second.index;
+    }
+    ++stats.compiled;
+    Code fragment{_jit = jit_new_state(), called(rpn), 1};
+    int index =
+        add_fragment((pfrag)emit(compile_fragment(rpn.c_str(), columns)));
+    for (int k : fragment.calls)
+      ++code_of.at(k).refs;
+    code_of[index] = fragment;
+    cache[rpn] = {index, clock};
+    return index;
+  }
+
+  // down to three quarters of capacity, so eviction runs now and then
+  void evict() {
+    vector<uint64_t> used;
+    for (const auto &entry : cache)
+      used.push_back(entry.second.used);
+    auto keep = used.end() - capacity * 3 / 4;
+    nth_element(used.begin(), keep, used.end());
+    uint64_t oldest = keep == used.end() ? UINT64_MAX : *keep;
+    for (auto it = cache.begin(); it != cache.end();)
+      if (it->second.used < oldest) {
+        release(it->second.index);
+        it = cache.erase(it);
+      } else {
+        ++it;
+      }
+  }
+
+  bool column(const S &s) const {
+    for (const auto &col : columns)
+      if (col.sym == s.sym)
+        return true;
+    return false;
+  }
+
+  // rpn of s, large subtrees replaced by calls; *nodes counts what's left
+  string lower(const S &s, int *nodes, bool root = false) {
+    if (s.rest.empty() && is_identifier(s.head) && !host_function(s.sym) &&
+        !column(s))
+      throw runtime_error("fragments cannot read the variable " + s.head);
+    string rpn;
+    *nodes = 1;
+    for (const auto &arg : s.rest) {
+      int n;
+      rpn += (rpn.empty() ? "" : " ") + lower(*arg, &n);
+      *nodes += n;
+    }
+    string_view word = rpn_word(s.head, s.rest.size());
+    if (!word.empty())
+      rpn += (rpn.empty() ? "" : " ") + string(word);
+    if (*nodes < FRAGMENT_NODES || root)
+      return rpn;
+    *nodes = 1;
+    return "frag#" + std::to_string(code(rpn));
+  }
+};
+
+// Apache Arrow C Data Interface, copied from the specification so that no
+// Arrow library is needed to exchange columns with other components.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+  void (*release)(struct ArrowSchema *);
+  void *private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+  void (*release)(struct ArrowArray *);
+  void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+// int32 arrays are plain SoA columns; the array offset is applied to the
+// base pointer at call time so one kernel serves every batch
+vector<Column> arrow_columns(const vector<string> &names,
+                             const vector<const ArrowSchema *> &schemas) {
+  vector<Column> columns;
+  for (size_t k = 0; k < schemas.size(); ++k) {
+    if (string(schemas[k]->format) != "i")
+      throw runtime_error("arrow column " + names[k] + " is not int32");
+    columns.push_back({names[k], sizeof(int), 0});
+  }
+  return columns;
+}
+
+struct ArrowOutput {
+  const void *buffers[2];
+};
+
+void arrow_release_array(ArrowArray *array) {
+  auto *priv = (ArrowOutput *)array->private_data;
+  free((void *)priv->buffers[0]);
+  free((void *)priv->buffers[1]);
+  delete priv;
+  array->release = nullptr;
+}
+
+void arrow_release_schema(ArrowSchema *schema) { schema->release = nullptr; }
+
+// eight validity bits starting at an arbitrary bit offset
+uint8_t arrow_bits(const uint8_t *bitmap, int64_t bit, int64_t end) {
+  uint8_t bits = bitmap[bit / 8] >> (bit % 8);
+  if (bit % 8 && (bit / 8 + 1) * 8 < end)
+    bits |= bitmap[bit / 8 + 1] << (8 - bit % 8);
+  return bits;
+}
+
+// the first bit from i on, before end, that is set (or clear); whole
+// bytes of the other kind are skipped at once
+int64_t arrow_next(const uint8_t *bitmap, int64_t i, int64_t end, bool set) {
+  while (i < end) {
+    if (i % 8 == 0 && bitmap[i / 8] == (set ? 0 : 0xff))
+      i += 8;
+    else if ((bitmap[i / 8] >> (i % 8) & 1) == set)
+      return i;
+    else
+      ++i;
+  }
+  return end;
+}
+
+// Runs the kernel directly over the value buffers of the input arrays and
+// exports the result as a nullable int32 array whose validity is the AND of
+// the input bitmaps. That validity is worked out first and the kernel is
+// called on each run of valid rows, with the bases moved to its first row,
+// so a row that is null in any input is never evaluated: whatever its
+// slots hold cannot divide by zero. Null rows of the output hold 0. An
+// expression that can fault on valid values, such as a / (b - 1), should
+// come as a TrappingKernel.
+template <typename Kernel>
+void eval_arrow(const Kernel &kernel, const vector<const ArrowArray *> &in,
+                const vector<const ArrowSchema *> &schemas, ArrowArray *out,
+                ArrowSchema *out_schema) {
+  if (schemas.size() != in.size())
+    throw runtime_error("one arrow schema per array");
+  int64_t length = in.empty() ? 0 : in[0]->length;
+  if (length < 0 || length > INT32_MAX)
+    throw runtime_error("arrow arrays of " + std::to_string(length) +
+                        " rows are not supported");
+  vector<const int *> bases;
+  for (size_t k = 0; k < in.size(); ++k) {
+    const ArrowArray *array = in[k];
+    if (string(schemas[k]->format) != "i" || array->n_buffers != 2)
+      throw runtime_error("arrow array " + std::to_string(k) +
+                          " is not int32");
+    if (array->length != length)
+      throw runtime_error("arrow columns differ in length");
+    bases.push_back((const int *)array->buffers[1] + array->offset);
+  }
+
+  // buffers are padded to 64 bytes as the Arrow format recommends
+  int64_t bitmap_bytes = (length + 511) / 512 * 64;
+  int64_t value_bytes = (length * sizeof(int) + 63) / 64 * 64;
+  auto *priv = new ArrowOutput;
+  auto *validity = (uint8_t *)aligned_alloc(64, max<int64_t>(bitmap_bytes, 64));
+  auto *values = (int *)aligned_alloc(64, max<int64_t>(value_bytes, 64));
+  priv->buffers[0] = validity;
+  priv->buffers[1] = values;
+
+  memset(validity, 0xff, max<int64_t>(bitmap_bytes, 64));
+  for (const auto *array : in) {
+    auto *bitmap = (const uint8_t *)array->buffers[0];
+    if (!bitmap || array->null_count == 0)
+      continue;
+    int64_t end = array->offset + length;
+    for (int64_t b = 0; b < (length + 7) / 8; ++b)
+      validity[b] &= array->offset % 8 == 0
+                         ? bitmap[array->offset / 8 + b]
+                         : arrow_bits(bitmap, array->offset + b * 8, end);
+  }
+  if (length % 8)
+    validity[length / 8] &= (1 << (length % 8)) - 1;
+
+  vector<const void *> run(bases.size());
+  try {
+    for (int64_t lo = 0; lo < length;) {
+      int64_t first = arrow_next(validity, lo, length, true);
+      memset(values + lo, 0, (first - lo) * sizeof(int));
+      if (first == length)
+        break;
+      lo = arrow_next(validity, first, length, false);
+      for (size_t k = 0; k < bases.size(); ++k)
+        run[k] = bases[k] + first;
+      kernel(run.data(), values + first, int(lo - first));
+    }
+  } catch (...) {
+    free(validity);
+    free(values);
+    delete priv;
+    throw;
+  }
+
+  int64_t valid = 0;
+  for (int64_t b = 0; b < (length + 7) / 8; ++b)
+    valid += __builtin_popcount(validity[b]);
+
+  *out = {length,  length - valid, 0,       2, 0, priv->buffers,
+          nullptr, nullptr,        arrow_release_array, priv};
+  *out_schema = {"i",     "",      nullptr, ARROW_FLAG_NULLABLE,
+                 0,       nullptr, nullptr, arrow_release_schema,
+                 nullptr};
+}
+
+// identifiers referenced by an rpn string, in order of first use
+vector<string> rpn_variables(const string &rpn) {
+  vector<string> names;
+  istringstream iss(rpn);
+  string word;
+  while (iss >> word)
+    if (is_identifier(word) && word.find('#') == string::npos &&
+        !host_function(symbols.find(word)) &&
+        find(names.begin(), names.end(), word) == names.end())
+      names.push_back(word);
+  return names;
+}
+
+// Bitmasks of the '"' and '\n' bytes in a 64 byte block: the structural
+// index the JSONL scanner walks instead of looking at every byte.
+void json_structurals(const char *p, size_t len, uint64_t *quotes,
+                      uint64_t *newlines) {
+  *quotes = *newlines = 0;
+#ifdef __SSE2__
+  if (len == 64) {
+    const __m128i quote = _mm_set1_epi8('"'), newline = _mm_set1_epi8('\n');
+    for (int i = 0; i < 4; ++i) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+      *quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                     _mm_cmpeq_epi8(block, quote))
+                 << (16 * i);
+      *newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                       _mm_cmpeq_epi8(block, newline))
+                   << (16 * i);
+    }
+    return;
+  }
+#endif
+  for (size_t i = 0; i < len; ++i) {
+    *quotes |= (uint64_t)(p[i] == '"') << i;
+    *newlines |= (uint64_t)(p[i] == '\n') << i;
+  }
+}
+
+// integer part of the JSON number at p; fractions are truncated since the
+// evaluator works on ints
+int json_int(const char *p, const char *end) {
+  bool negative = p < end && *p == '-';
+  p += negative;
+  long value = 0;
+  while (p < end && isdigit(*p))
+    value = value * 10 + (*p++ - '0');
+  return negative ? -value : value;
+}
+
+static const int JSONL_BLOCK = 1024;
+
+// Scans the records in [p, end), pulling the named numeric fields of each
+// record into an AoS block that the strided batch kernel consumes in place.
+// Keys are matched at any nesting depth; a missing field reads as 0.
+void jsonl_scan(const char *p, const char *end, const vector<string> &fields,
+                pbatch kernel, vector<int> &out) {
+  size_t nfields = fields.size();
+  vector<int> block(JSONL_BLOCK * max<size_t>(nfields, 1));
+  vector<const void *> bases(nfields, block.data());
+  int rows = 0;
+  int *row = block.data();
+  fill(row, row + nfields, 0);
+  bool in_string = false;
+  const char *line_start = p, *string_start = nullptr;
+
+  auto flush = [&]() {
+    out.resize(out.size() + rows);
+    kernel(bases.data(), out.data() + out.size() - rows, rows);
+    rows = 0;
+  };
+  auto end_record = [&](const char *line_end) {
+    if (line_end > line_start && ++rows == JSONL_BLOCK)
+      flush();
+    row = block.data() + rows * nfields;
+    fill(row, row + nfields, 0);
+    line_start = line_end + 1;
+    in_string = false;
+  };
+
+  for (const char *base = p; base < end; base += 64) {
+    uint64_t quotes, newlines;
+    json_structurals(base, min<size_t>(64, end - base), &quotes, &newlines);
+    uint64_t bits = quotes | newlines;
+    while (bits) {
+      const char *s = base + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      if (*s == '\n') {
+        end_record(s);
+        continue;
+      }
+      // a quote preceded by an odd run of backslashes is escaped
+      size_t slashes = 0;
+      while (s - slashes > p && s[-1 - (long)slashes] == '\\')
+        ++slashes;
+      if (in_string && slashes % 2)
+        continue;
+      if (!in_string) {
+        in_string = true;
+        string_start = s + 1;
+        continue;
+      }
+      in_string = false;
+      const char *colon = s + 1;
+      while (colon < end && isspace(*colon) && *colon != '\n')
+        ++colon;
+      if (colon == end || *colon != ':')
+        continue;
+      string_view key(string_start, s - string_start);
+      for (size_t k = 0; k < nfields; ++k) {
+        if (key == fields[k]) {
+          const char *value = colon + 1;
+          while (value < end && (*value == ' ' || *value == '\t'))
+            ++value;
+          row[k] = json_int(value, end);
+          break;
+        }
+      }
+    }
+  }
+  if (end > line_start)
+    end_record(end);
+  if (rows)
+    flush();
+}
+
+struct JsonlStats {
+  size_t bytes;
+  double seconds;
+};
+
+// Evaluates the rpn expression once per record of an mmap'd JSON-lines
+// file, splitting the file at record boundaries across threads.
+vector<int> eval_jsonl(const string &path, const string &line,
+                       JsonlStats *stats = nullptr, unsigned threads = 0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("cannot open " + path);
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  const char *data = (const char *)"";
+  if (size) {
+    data = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("cannot mmap " + path);
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  auto fields = rpn_variables(line);
+  vector<Column> columns;
+  for (size_t k = 0; k < fields.size(); ++k)
+    columns.push_back({fields[k], (long)(fields.size() * sizeof(int)),
+                       (long)(k * sizeof(int))});
+  auto kernel = eval_batch(line, columns);
+
+  if (!threads)
+    threads = min<size_t>(max(1u, thread::hardware_concurrency()),
+                          size / (1 << 16) + 1);
+  vector<const char *> cuts{data};
+  for (unsigned t = 1; t < threads; ++t) {
+    const char *cut = data + size * t / threads;
+    cut = max(cut, cuts.back());
+    const char *nl = (const char *)memchr(cut, '\n', data + size - cut);
+    cuts.push_back(nl ? nl + 1 : data + size);
+  }
+  cuts.push_back(data + size);
+
+  auto start = chrono::steady_clock::now();
+  vector<vector<int>> parts(threads);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+    workers.emplace_back(jsonl_scan, cuts[t], cuts[t + 1], cref(fields),
+                         kernel, ref(parts[t]));
+  for (auto &w : workers)
+    w.join();
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (size)
+    munmap((void *)data, size);
+  if (stats)
+    *stats = {size, seconds};
+
+  vector<int> out;
+  for (auto &part : parts)
+    out.insert(out.end(), part.begin(), part.end());
+  return out;
+}
+
+struct ForkStats {
+  int restarts = 0;
+  double seconds = 0;
+};
+
+// Runs a batch kernel over rows [0, n) in forked worker processes so that
+// a crashing expression takes down a worker, not the caller. Worker w
+// evaluates one contiguous shard straight into a MAP_SHARED mapping of
+// path, row i at offset i * width; the inputs are inherited
+// copy-on-write. A worker that dies is started again on its shard up to
+// retries times, after which the call throws. The returned mapping stays
+// valid after the file is unlinked.
+shared_ptr<int> eval_forked(pbatch kernel, const vector<Column> &columns,
+                            const void *const *bases, int n,
+                            const string &path, int width = 1,
+                            unsigned workers = 0, int retries = 2,
+                            ForkStats *stats = nullptr) {
+  size_t bytes = max<size_t>(size_t(n) * width * sizeof(int), 1);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw runtime_error("cannot open " + path);
+  if (ftruncate(fd, bytes) != 0) {
+    close(fd);
+    throw runtime_error("cannot size " + path);
+  }
+  void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    throw runtime_error("cannot map " + path);
+  shared_ptr<int> out((int *)map, [bytes](int *p) { munmap(p, bytes); });
+
+  if (workers == 0)
+    workers = max(1u, thread::hardware_concurrency());
+  workers = max(1u, min<unsigned>(workers, n));
+  // packed columns are read from their first row, so they take one shard
+  for (const auto &col : columns)
+    if (col.bits)
+      workers = 1;
+
+  // every shard's shifted bases are laid out before forking, so a worker
+  // runs nothing but the kernel. A grid axis has no buffer to shift: its
+  // base points at the index of the first sample, so the shard gets an
+  // index of its own, lo further on when the axis advances with the row.
+  struct Shard {
+    int lo, hi;
+    vector<const void *> bases;
+    vector<int> first_sample; // by column, for grid axes
+    pid_t pid;
+    int attempts;
+  };
+  vector<Shard> shards;
+  for (unsigned w = 0; w < workers; ++w) {
+    Shard shard{int(int64_t(n) * w / workers),
+                int(int64_t(n) * (w + 1) / workers), {}, {}, 0, 0};
+    shard.first_sample.resize(columns.size());
+    for (size_t k = 0; k < columns.size(); ++k) {
+      const Column &col = columns[k];
+      if (col.samples) {
+        shard.first_sample[k] =
+            *(const int *)bases[k] + (col.stride ? shard.lo : 0);
+        shard.bases.push_back(&shard.first_sample[k]);
+      } else {
+        shard.bases.push_back((const char *)bases[k] +
+                              col.stride * size_t(shard.lo));
+      }
+    }
+    shards.push_back(std::move(shard));
+  }
+  auto spawn = [&](Shard &shard) {
+    ++shard.attempts;
+    shard.pid = fork();
+    if (shard.pid < 0)
+      throw runtime_error("fork failed");
+    if (shard.pid == 0) {
+      kernel(shard.bases.data(), out.get() + size_t(shard.lo) * width,
+             shard.hi - shard.lo);
+      _exit(0);
+    }
+  };
+
+  auto start = chrono::steady_clock::now();
+  int restarts = 0;
+  string failed;
+  for (auto &shard : shards)
+    spawn(shard);
+  for (auto &shard : shards) {
+    while (true) {
+      int status = 0, error = 0;
+      // a worker that cannot be waited for counts as crashed
+      while (waitpid(shard.pid, &status, 0) < 0)
+        if (errno != EINTR) {
+          error = errno;
+          break;
+        }
+      if (!error && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        break;
+      if (shard.attempts > retries) {
+        string why = "exit " + std::to_string(WEXITSTATUS(status));
+        if (error)
+          why = string("waitpid: ") + strerror(error);
+        else if (WIFSIGNALED(status))
+          why = strsignal(WTERMSIG(status));
+        failed += " [" + std::to_string(shard.lo) + ", " +
+                  std::to_string(shard.hi) + "): " + why;
+        break;
+      }
+      ++restarts;
+      spawn(shard);
+    }
+  }
+  if (stats)
+    *stats = {restarts,
+              chrono::duration<double>(chrono::steady_clock::now() - start)
+                  .count()};
+  if (!failed.empty())
+    throw runtime_error("batch workers failed on rows" + failed);
+  return out;
+}
+
+// Opt-in checking by the hardware instead of by the kernel: divisions
+// stay unguarded and reads past the end of a guarded array hit a page no
+// one may read. A SIGFPE or SIGSEGV raised while a TrappingKernel runs is
+// turned into a TrapError naming its expression, so a correct kernel pays
+// only a sigsetjmp per call, which leaves the signal mask alone. Faults
+// elsewhere get the handler that was installed before. The handler runs
+// on a stack of its own, so a host function called by the kernel that
+// overflows the stack is covered too; the frames of host functions are
+// left without running destructors.
+struct TrapError : runtime_error {
+  int signal;
+  const void *address;
+  bool guard; // the address is in the guard page of a guarded array
+
+  TrapError(const string &what, int signal, const void *address, bool guard)
+      : runtime_error(what), signal(signal), address(address), guard(guard) {}
+};
+
+static thread_local sigjmp_buf *trap_target = nullptr;
+static thread_local siginfo_t trap_info;
+static thread_local sigset_t trap_mask; // the thread's mask at the fault
+static struct sigaction trap_previous[2];
+
+void trap_handler(int sig, siginfo_t *info, void *context) {
+  if (trap_target) {
+    trap_info = *info;
+    trap_mask = ((ucontext_t *)context)->uc_sigmask;
+    siglongjmp(*trap_target, 1);
+  }
+  // not ours: hand over, and let the instruction fault again
+  struct sigaction &previous = trap_previous[sig == SIGSEGV];
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(sig, info, context);
+  } else if (previous.sa_handler != SIG_DFL &&
+             previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  } else {
+    sigaction(sig, &previous, nullptr);
+  }
+}
+
+void install_trap_handlers() {
+  static once_flag once;
+  call_once(once, [] {
+    struct sigaction action = {};
+    action.sa_sigaction = trap_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGFPE, &action, &trap_previous[0]);
+    sigaction(SIGSEGV, &action, &trap_previous[1]);
+  });
+}
+
+// Guarded arrays end right where a PROT_NONE page starts, so element n of
+// an n-element array is the first address that faults.
+struct GuardRange {
+  uintptr_t lo, hi;
+};
+static vector<GuardRange> guard_pages;
+static mutex guard_pages_mu;
+
+shared_ptr<int> guarded_array(size_t n) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t bytes = (n * sizeof(int) + page - 1) / page * page;
+  char *map = (char *)mmap(nullptr, bytes + page, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    throw runtime_error("cannot map a guarded array");
+  mprotect(map + bytes, page, PROT_NONE);
+  uintptr_t guard = uintptr_t(map + bytes);
+  {
+    lock_guard<mutex> lock(guard_pages_mu);
+    guard_pages.push_back({guard, guard + page});
+  }
+  auto release = [map, bytes, page, guard](int *) {
+    {
+      lock_guard<mutex> lock(guard_pages_mu);
+      guard_pages.erase(
+          find_if(guard_pages.begin(), guard_pages.end(),
+                  [guard](GuardRange r) { return r.lo == guard; }));
+    }
+    munmap(map, bytes + page);
+  };
+  return shared_ptr<int>((int *)(map + bytes) - n, release);
+}
+
+bool in_guard_page(const void *address) {
+  lock_guard<mutex> lock(guard_pages_mu);
+  for (GuardRange r : guard_pages)
+    if (uintptr_t(address) >= r.lo && uintptr_t(address) < r.hi)
+      return true;
+  return false;
+}
+
+class TrappingKernel {
+public:
+  TrappingKernel(pbatch kernel, string expr)
+      : kernel(kernel), expr(std::move(expr)) {
+    install_trap_handlers();
+  }
+
+  void operator()(const void *const *bases, int *out, int n) const {
+    static thread_local AltStack stack;
+    sigjmp_buf target;
+    sigjmp_buf *outer = trap_target;
+    if (sigsetjmp(target, 0)) {
+      // the handler left the signal blocked
+      pthread_sigmask(SIG_SETMASK, &trap_mask, nullptr);
+      trap_target = outer;
+      throw fault();
+    }
+    trap_target = &target;
+    kernel(bases, out, n);
+    trap_target = outer;
+  }
+
+private:
+  // the thread's stack for signal handlers, unless it has one already
+  struct AltStack {
+    vector<char> memory;
+
+    AltStack() {
+      stack_t old;
+      if (sigaltstack(nullptr, &old) == 0 && !(old.ss_flags & SS_DISABLE))
+        return;
+      memory.resize(max<size_t>(SIGSTKSZ, 1 << 16));
+      stack_t ss = {};
+      ss.ss_sp = memory.data();
+      ss.ss_size = memory.size();
+      sigaltstack(&ss, nullptr);
+    }
+    ~AltStack() {
+      if (memory.empty())
+        return;
+      stack_t ss = {};
+      ss.ss_flags = SS_DISABLE;
+      sigaltstack(&ss, nullptr);
+    }
+  };
+
+  pbatch kernel;
+  string expr;
+
+  TrapError fault() const {
+    int sig = trap_info.si_signo;
+    const void *address = trap_info.si_addr;
+    bool guard = sig == SIGSEGV && in_guard_page(address);
+    string what = sig == SIGFPE ? "integer division by zero or overflow"
+                  : guard       ? "read past the end of a guarded array"
+                                : "invalid memory access";
+    return TrapError(what + " in '" + expr + "'", sig, address, guard);
+  }
+};
+
+// eval_batch() whose faults come back as TrapError
+TrappingKernel eval_batch_trapping(const shared_ptr<S> &e,
+                                   const vector<Column> &columns, int *width,
+                                   int level = opt_level) {
+  return TrappingKernel(eval_batch(e, columns, width, level), e->to_string());
+}
+
+// Compiled functions whose code can move. Code is emitted into REGION
+// sized mappings that evicted functions leave holes in; compact()
+// regenerates the live functions, the most called first, into fresh
+// regions and swaps their entries. Each is regenerated as add() compiled
+// it, with the host functions then registered and the optimize_size of
+// the thread that added it. Callers look an entry up and call it
+// under a Pin; the old regions are unmapped once every thread pinned
+// before the swap has let go (epoch-based reclamation).
+class CodeHeap {
+  static const uint64_t IDLE = UINT64_MAX;
+
+  // one per thread and heap, holding the epoch the thread is pinned at
+  struct Reader {
+    atomic<uint64_t> epoch{IDLE};
+    int depth = 0;
+  };
+
+public:
+  static const size_t REGION = 1 << 16;
+
+  // capacity bounds the ids ever handed out; the entry table is fixed so
+  // callers can read it while functions are added
+  explicit CodeHeap(size_t capacity = 1 << 16)
+      : capacity(capacity), slots(new Slot[capacity]) {}
+
+  struct Stats {
+    size_t functions = 0, regions = 0, mapped = 0, used = 0, live = 0;
+    size_t rss = 0;
+    double fragmentation = 0; // share of used bytes that are dead code
+  };
+
+  class Pin {
+  public:
+    explicit Pin(CodeHeap &heap) : reader(heap.reader()) {
+      if (reader.depth++ == 0) {
+        reader.epoch.store(heap.epoch.load());
+        atomic_thread_fence(memory_order_seq_cst);
+      }
+    }
+    ~Pin() {
+      if (--reader.depth == 0)
+        reader.epoch.store(IDLE, memory_order_release);
+    }
+    Pin(const Pin &) = delete;
+
+  private:
+    Reader &reader;
+  };
+
+  ~CodeHeap() {
+    for (auto &r : regions)
+      munmap(r->base, r->size);
+    for (auto &retired : limbo)
+      for (auto &r : retired.regions)
+        munmap(r->base, r->size);
+  }
+
+  int add(const string &rpn) { return add(rpn, {}, 0); }
+
+  // a batch kernel, see compile_batch()
+  int add(const string &rpn, const vector<Column> &columns, int width) {
+    lock_guard<mutex> lock(mu);
+    if (functions.size() == capacity)
+      throw runtime_error("code heap entry table is full");
+    functions.emplace_back();
+    Function &f = functions.back();
+    f.rpn = rpn, f.columns = columns, f.width = width;
+    f.optimize_size = optimize_size;
+    f.registrations = host_registrations();
+    slots[functions.size() - 1].entry.store(emit(f, regions));
+    return functions.size() - 1;
+  }
+
+  void evict(int id) {
+    lock_guard<mutex> lock(mu);
+    Function &f = functions.at(id);
+    if (slots[id].entry.exchange(nullptr))
+      f.region->live -= f.bytes;
+  }
+
+  // valid while the caller holds a Pin
+  pifv scalar(int id) { return (pifv)lookup(id); }
+  pbatch batch(int id) { return (pbatch)lookup(id); }
+
+  int call(int id) {
+    Pin pin(*this);
+    return scalar(id)();
+  }
+
+  void compact() {
+    lock_guard<mutex> lock(mu);
+    vector<size_t> live;
+    for (size_t id = 0; id < functions.size(); ++id)
+      if (slots[id].entry.load())
+        live.push_back(id);
+    stable_sort(live.begin(), live.end(), [this](size_t a, size_t b) {
+      return slots[a].calls.load(memory_order_relaxed) >
+             slots[b].calls.load(memory_order_relaxed);
+    });
+    vector<unique_ptr<Region>> fresh;
+    vector<void *> entries;
+    for (size_t id : live)
+      entries.push_back(emit(functions[id], fresh));
+    for (size_t i = 0; i < live.size(); ++i)
+      slots[live[i]].entry.store(entries[i]);
+    limbo.push_back({std::move(regions), epoch.fetch_add(1) + 1});
+    regions = std::move(fresh);
+    reclaim_locked();
+  }
+
+  // unmaps what no pinned thread can still be running
+  void reclaim() {
+    lock_guard<mutex> lock(mu);
+    reclaim_locked();
+  }
+
+  Stats stats() {
+    lock_guard<mutex> lock(mu);
+    Stats s;
+    for (size_t id = 0; id < functions.size(); ++id)
+      s.functions += slots[id].entry.load() != nullptr;
+    for (auto &r : regions) {
+      ++s.regions;
+      s.mapped += r->size, s.used += r->used, s.live += r->live;
+    }
+    for (auto &retired : limbo)
+      for (auto &r : retired.regions)
+        s.mapped += r->size;
+    s.fragmentation = s.used ? 1 - double(s.live) / s.used : 0;
+    long pages = 0, resident = 0;
+    if (FILE *statm = fopen("/proc/self/statm", "r")) {
+      if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+      fclose(statm);
+    }
+    s.rss = resident * sysconf(_SC_PAGESIZE);
+    return s;
+  }
+
+private:
+  struct Region {
+    char *base;
+    size_t size, used = 0, live = 0;
+  };
+  struct Function {
+    string rpn;
+    vector<Column> columns;
+    int width; // 0 for a scalar function
+    bool optimize_size;
+    size_t registrations; // see host_registry_as_of
+    Region *region = nullptr;
+    size_t bytes = 0;
+  };
+  struct Slot {
+    atomic<void *> entry{nullptr};
+    atomic<uint64_t> calls{0};
+  };
+  struct Retired {
+    vector<unique_ptr<Region>> regions;
+    uint64_t epoch; // free once no reader is pinned at an earlier one
+  };
+
+  const size_t capacity;
+  unique_ptr<Slot[]> slots;
+  deque<Function> functions;
+  vector<unique_ptr<Region>> regions;
+  vector<Retired> limbo;
+  atomic<uint64_t> epoch{0};
+  static inline atomic<uint64_t> heaps{0};
+  const uint64_t serial = heaps++; // keys the per-thread readers
+  deque<Reader> readers;
+  mutex mu, readers_mu;
+
+  Reader &reader() {
+    static thread_local unordered_map<uint64_t, Reader *> mine;
+    Reader *&r = mine[serial];
+    if (!r) {
+      lock_guard<mutex> lock(readers_mu);
+      readers.emplace_back();
+      r = &readers.back();
+    }
+    return *r;
+  }
+
+  void *lookup(int id) {
+    if (id < 0 || size_t(id) >= capacity)
+      throw out_of_range("no such function");
+    Slot &s = slots[id];
+    s.calls.fetch_add(1, memory_order_relaxed);
+    void *entry = s.entry.load(memory_order_acquire);
+    if (!entry)
+      throw runtime_error("call to an evicted function");
+    return entry;
+  }
+
+  Region &region_for(size_t bytes, vector<unique_ptr<Region>> &into) {
+    if (into.empty() || into.back()->size - into.back()->used < bytes) {
+      size_t size = max(REGION, (bytes + REGION - 1) / REGION * REGION);
+      void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (map == MAP_FAILED)
+        throw runtime_error("cannot map a code region");
+      into.push_back(make_unique<Region>(Region{(char *)map, size}));
+    }
+    return *into.back();
+  }
+
+  // the compile options of f on this thread until it goes
+  struct Options {
+    bool size = optimize_size;
+    size_t as_of = host_registry_as_of;
+    explicit Options(const Function &f) {
+      optimize_size = f.optimize_size;
+      host_registry_as_of = f.registrations;
+    }
+    ~Options() {
+      optimize_size = size;
+      host_registry_as_of = as_of;
+    }
+  };
+
+  void *emit(Function &f, vector<unique_ptr<Region>> &into) {
+    Options options(f);
+    _jit = jit_new_state();
+    jit_node_t *fn = f.width ? compile_batch(f.rpn.c_str(), f.columns, f.width)
+                             : compile_rpn(f.rpn.c_str());
+    jit_realize();
+    jit_word_t bytes;
+    jit_get_code(&bytes);
+    // the size is an estimate: code that outgrows it is emitted again
+    // into twice the room
+    Region *r;
+    for (size_t room = bytes;; room = 2 * (r->size - r->used)) {
+      r = &region_for(room, into);
+      jit_set_code(r->base + r->used, r->size - r->used);
+      if (jit_emit())
+        break;
+    }
+    void *entry = jit_address(fn);
+    jit_get_code(&bytes);
+    jit_clear_state();
+    code_bytes += bytes;
+    // next function starts aligned, if there is room for one
+    bytes = min<size_t>((bytes + 15) & ~15, r->size - r->used);
+    r->used += bytes, r->live += bytes;
+    f.region = r, f.bytes = bytes;
+    return entry;
+  }
+
+  void reclaim_locked() {
+    uint64_t oldest = IDLE;
+    {
+      lock_guard<mutex> lock(readers_mu);
+      for (auto &r : readers)
+        oldest = min(oldest, r.epoch.load());
+    }
+    auto safe = [oldest](const Retired &r) { return oldest >= r.epoch; };
+    for (auto &retired : limbo)
+      if (safe(retired))
+        for (auto &r : retired.regions)
+          munmap(r->base, r->size);
+    limbo.erase(remove_if(limbo.begin(), limbo.end(), safe), limbo.end());
+  }
+};
+
+// A batch kernel for profiling runs: it records its calls and rows, the
+// range of each input column and how many results are nonzero, and
+// counters in its code count which way each '?' goes. Calls from one
+// thread at a time; production kernels are built from the saved profile by
+// eval_batch_pgo() and measure nothing.
+class ProfilingKernel {
+public:
+  ProfilingKernel(pbatch kernel, vector<Column> columns, int width,
+                  Profile::Entry *entry)
+      : kernel(kernel), columns(std::move(columns)), width(width),
+        entry(entry) {}
+
+  void operator()(const void *const *bases, int *out, int n) const {
+    kernel(bases, out, n);
+    ++entry->calls;
+    entry->rows += n;
+    for (int i = 0; i < n; ++i)
+      entry->nonzero += any_of(out + i * width, out + (i + 1) * width,
+                               [](int v) { return v != 0; });
+    for (size_t k = 0; k < columns.size(); ++k) {
+      const Column &col = columns[k];
+      if (col.samples || col.bits || n <= 0)
+        continue;
+      int elements = col.rows * col.cols * (col.complex ? 2 : 1);
+      const char *base = (const char *)bases[k] + col.offset;
+      int lo = INT32_MAX, hi = INT32_MIN;
+      for (int i = 0; i < n; ++i)
+        for (int j = 0; j < elements; ++j) {
+          int v = ((const int *)(base + i * col.stride))[j];
+          lo = min(lo, v), hi = max(hi, v);
+        }
+      auto r = find_if(
+          entry->ranges.begin(), entry->ranges.end(),
+          [&col](const VarRange &r) { return r.name == col.name; });
+      if (r == entry->ranges.end())
+        entry->ranges.push_back({col.name, lo, hi});
+      else
+        r->lo = min(r->lo, lo), r->hi = max(r->hi, hi);
+    }
+  }
+
+private:
+  pbatch kernel;
+  vector<Column> columns;
+  int width;
+  Profile::Entry *entry;
+};
+
+// eval_batch() instrumented to record into profile
+ProfilingKernel eval_batch_profiling(const shared_ptr<S> &e,
+                                     const vector<Column> &columns,
+                                     int *width, Profile &profile,
+                                     int level = opt_level) {
+  Profile::Entry *entry = &profile.entries[Profile::key(e)];
+  auto shaped =
+      lower_shapes(lower_comprehensions(lower_tables(e)), columns, width);
+  vector<Profile::Branch *> counters;
+  auto scalar = BranchLowering(nullptr, &counters, entry).lower(shaped);
+  branch_counters = counters;
+  pbatch kernel = eval_batch(passes().run(scalar, level)->to_string(),
+                             columns, *width);
+  branch_counters.clear();
+  return ProfilingKernel(kernel, columns, *width, entry);
+}
+
+// A kernel built with a profile's help. Expressions that ran at least
+// HOT_SHARE of the profiled rows are optimized at -O3, and when the input
+// ranges the profile saw let range analysis simplify them, a copy
+// specialised to those ranges runs on each block of BLOCK rows whose inputs
+// stay in them; the block is checked just before it runs, while it is in
+// cache. Expressions the profile never saw run are generated for size, as
+// optimize_size does. Each '?' puts its likelier arm first.
+class ProfiledKernel {
+public:
+  static constexpr double HOT_SHARE = 0.01;
+  static const int BLOCK = 1024;
+
+  ProfiledKernel(pbatch general, string rpn, vector<Column> columns,
+                 int width)
+      : general(general), rpn(rpn), columns(std::move(columns)),
+        width(width) {}
+
+  void operator()(const void *const *bases, int *out, int n) const {
+    if (!fast)
+      return general(bases, out, n);
+    // packed and grid columns cannot start mid-call
+    bool whole = any_of(columns.begin(), columns.end(), [](const Column &c) {
+      return c.bits || c.samples;
+    });
+    if (whole)
+      return (in_ranges(bases, n) ? fast : general)(bases, out, n);
+    vector<const void *> block(columns.size());
+    for (int lo = 0; lo < n; lo += BLOCK) {
+      int rows = min(BLOCK, n - lo);
+      for (size_t k = 0; k < columns.size(); ++k)
+        block[k] = (const char *)bases[k] + columns[k].stride * size_t(lo);
+      (in_ranges(block.data(), rows) ? fast : general)(
+          block.data(), out + size_t(lo) * width, rows);
+    }
+  }
+
+  bool specialised() const { return fast != nullptr; }
+
+  pbatch general, fast = nullptr;
+  string rpn; // of the general kernel
+  vector<pair<Column, VarRange>> guards; // what fast assumes, by column
+  vector<int> slots;                     // bases index of each guard
+
+private:
+  vector<Column> columns;
+  int width;
+
+  bool in_ranges(const void *const *bases, int n) const {
+    for (size_t g = 0; g < guards.size(); ++g) {
+      const auto &[col, range] = guards[g];
+      const char *base = (const char *)bases[slots[g]] + col.offset;
+      for (int i = 0; i < n; ++i) {
+        int v = *(const int *)(base + i * col.stride);
+        if (v < range.lo || v > range.hi)
+          return false;
+      }
+    }
+    return true;
+  }
+};
+
+ProfiledKernel eval_batch_pgo(const shared_ptr<S> &e,
+                              const vector<Column> &columns, int *width,
+                              const Profile &profile) {
+  const Profile::Entry *entry = profile.find(e);
+  uint64_t total = profile.rows();
+  bool cold = !entry || !entry->calls,
+       hot = !cold && entry->rows >= ProfiledKernel::HOT_SHARE * total;
+  bool size = optimize_size;
+  optimize_size = size || cold;
+  auto shaped =
+      lower_shapes(lower_comprehensions(lower_tables(e)), columns, width);
+  auto scalar = lower_branches(shaped, entry);
+
+  auto general = passes().run(scalar, cold ? 1 : hot ? 3 : opt_level);
+  ProfiledKernel kernel(eval_batch(general->to_string(), columns, *width),
+                        general->to_string(), columns, *width);
+  if (hot) {
+    vector<VarRange> ranges;
+    for (size_t k = 0; k < columns.size(); ++k)
+      for (const auto &r : entry->ranges)
+        if (r.name == columns[k].name && !columns[k].samples &&
+            !columns[k].bits &&
+            columns[k].rows * columns[k].cols == 1 && !columns[k].complex) {
+          ranges.push_back(r);
+          kernel.guards.push_back({columns[k], r});
+          kernel.slots.push_back(k);
+        }
+    auto special = passes().run(scalar, 3, ranges);
+    if (special->to_string() != kernel.rpn)
+      kernel.fast = eval_batch(special->to_string(), columns, *width);
+    else
+      kernel.guards.clear(), kernel.slots.clear();
+  }
+  optimize_size = size;
+  return kernel;
+}
+
+// Optional memo table in front of a pure compiled expression of arity int
+// inputs, for callers that keep evaluating the same inputs; the kernel is
+// a batch kernel over columns of stride sizeof(int), run on one row.
+// Lookups are lock-free and never allocate. Each set holds WAYS entries,
+// and each entry a sequence number that is odd while it is written, so a
+// reader never accepts a torn entry and a writer skips an entry another
+// writer holds. The hit rate of each WINDOW of calls decides whether the
+// table is used; a disabled table tries another window now and then.
+class MemoTable {
+public:
+  static const int WAYS = 4;
+  static const uint64_t WINDOW = 4096, REPROBE = 16 * WINDOW;
+  static constexpr double MIN_HIT_RATE = 0.05;
+
+  struct Stats {
+    uint64_t hits, misses, bypassed;
+    bool enabled;
+  };
+
+  MemoTable(pbatch kernel, int arity, size_t sets = 1024)
+      : kernel(kernel), arity(arity), sets(pow2(sets)),
+        seq(new atomic<uint32_t>[this->sets * WAYS]()),
+        slots(new atomic<int>[this->sets * WAYS * (arity + 1)]()) {}
+
+  int operator()(const int *args) {
+    if (!enabled.load(memory_order_relaxed)) {
+      if (bypassed.fetch_add(1, memory_order_relaxed) % REPROBE ==
+          REPROBE - 1)
+        enabled.store(true, memory_order_relaxed);
+      return compute(args);
+    }
+    uint64_t h = hash(args);
+    size_t set = (h & (sets - 1)) * WAYS;
+    int value;
+    for (int w = 0; w < WAYS; ++w)
+      if (probe(set + w, args, &value)) {
+        count(true);
+        return value;
+      }
+    value = compute(args);
+    // an empty way if the set has one, else a victim picked by the hash
+    size_t way = h >> 62;
+    for (int w = 0; w < WAYS; ++w)
+      if (seq[set + w].load(memory_order_relaxed) == 0) {
+        way = w;
+        break;
+      }
+    store(set + way, args, value);
+    count(false);
+    return value;
+  }
+
+  Stats stats() const {
+    return {hits.load(), misses.load(), bypassed.load(), enabled.load()};
+  }
+
+private:
+  pbatch kernel;
+  int arity;
+  size_t sets;
+  unique_ptr<atomic<uint32_t>[]> seq; // 0 empty, odd while written
+  unique_ptr<atomic<int>[]> slots;    // arity keys then the value
+  atomic<uint64_t> hits{0}, misses{0}, bypassed{0};
+  atomic<uint64_t> window_calls{0}, window_hits{0};
+  atomic<bool> enabled{true};
+
+  static size_t pow2(size_t n) {
+    size_t p = 1;
+    while (p < n)
+      p *= 2;
+    return p;
+  }
+
+  uint64_t hash(const int *args) const {
+    uint64_t h = 0x9e3779b97f4a7c15;
+    for (int k = 0; k < arity; ++k)
+      h = (h ^ uint32_t(args[k])) * 0xff51afd7ed558ccd;
+    return h ^ (h >> 29);
+  }
+
+  int compute(const int *args) const {
+    const void *local[8];
+    vector<const void *> heap(arity > 8 ? arity : 0);
+    const void **bases = arity > 8 ? heap.data() : local;
+    for (int k = 0; k < arity; ++k)
+      bases[k] = args + k;
+    int value;
+    kernel(bases, &value, 1);
+    return value;
+  }
+
+  bool probe(size_t e, const int *args, int *value) const {
+    uint32_t s = seq[e].load(memory_order_acquire);
+    if (s == 0 || s & 1)
+      return false;
+    const atomic<int> *slot = &slots[e * (arity + 1)];
+    for (int k = 0; k < arity; ++k)
+      if (slot[k].load(memory_order_relaxed) != args[k])
+        return false;
+    *value = slot[arity].load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    return seq[e].load(memory_order_relaxed) == s;
+  }
+
+  void store(size_t e, const int *args, int value) {
+    uint32_t s = seq[e].load(memory_order_relaxed);
+    if (s & 1 || !seq[e].compare_exchange_strong(s, s + 1,
+                                                 memory_order_relaxed))
+      return;
+    atomic_thread_fence(memory_order_release);
+    atomic<int> *slot = &slots[e * (arity + 1)];
+    for (int k = 0; k < arity; ++k)
+      slot[k].store(args[k], memory_order_relaxed);
+    slot[arity].store(value, memory_order_relaxed);
+    seq[e].store(s + 2, memory_order_release);
+  }
+
+  void count(bool hit) {
+    (hit ? hits : misses).fetch_add(1, memory_order_relaxed);
+    if (hit)
+      window_hits.fetch_add(1, memory_order_relaxed);
+    if (window_calls.fetch_add(1, memory_order_relaxed) + 1 < WINDOW)
+      return;
+    // the caller that completes a window judges it
+    uint64_t h = window_hits.exchange(0, memory_order_relaxed);
+    window_calls.store(0, memory_order_relaxed);
+    enabled.store(h >= MIN_HIT_RATE * WINDOW, memory_order_relaxed);
+  }
+};
+
+#include <cassert>
+#include <iostream>
+
+void test_single_digit() {
+  assert(expr("3")->to_string() == "3");
+  assert(expr("42")->to_string() == "42");
+}
+
+void test_simple_operations() {
+  assert(expr("3 + 4")->to_string() == "3 4 +");
+  assert(expr("10 - 5")->to_string() == "10 5 -");
+  assert(expr("6 * 7")->to_string() == "6 7 *");
+  assert(expr("8 / 2")->to_string() == "8 2 /");
+}
+
+void test_operator_precedence() {
+  assert(expr("3 + 4 * 5")->to_string() == "3 4 5 * +");
+  assert(expr("10 - 5 / 5")->to_string() == "10 5 5 / -");
+  assert(expr("1 + 2 * 3 - 4 / 5")->to_string() == "1 2 3 * + 4 5 / -");
+}
+
+void test_parentheses() {
+  assert(expr("(3 + 4) * 5")->to_string() == "3 4 + 5 *");
+  assert(expr("(1 + 2) * (3 - 4)")->to_string() == "1 2 + 3 4 - *");
+}
+
+void test_nested_parentheses() {
+  assert(expr("((3 + 4) * 5) / 2")->to_string() == "3 4 + 5 * 2 /");
+  assert(expr("(1 + (2 * 3)) - (4 / (5 + 6))")->to_string() ==
+         "1 2 3 * + 4 5 6 + / -");
+}
+
+void test_complex_expressions() {
+  assert(expr("3 + 4 * 2 / (1 - 5) + 6")->to_string() ==
+         "3 4 2 * 1 5 - / + 6 +");
+  assert(expr("42 * (35 + 12) / (7 - 3) + 8")->to_string() ==
+         "42 35 12 + * 7 3 - / 8 +");
+}
+
+void test_unary_operations() {
+  assert(expr("-3")->to_string() == "3 --");
+  assert(expr("+42")->to_string() == "42");
+  assert(expr("-3 + 4")->to_string() == "3 -- 4 +");
+  assert(expr("-3 * (4 + 2)")->to_string() == "3 -- 4 2 + *");
+}
+
+void test_edge_cases() {
+  // Minimal input
+  assert(expr("1")->to_string() == "1");
+
+  // Extra spaces
+  assert(expr("  3   + 4   ")->to_string() == "3 4 +");
+
+  // Complex parentheses
+  assert(expr("(((3)))")->to_string() == "3");
+  assert(expr("(3 + (4 * (5)))")->to_string() == "3 4 5 * +");
+
+  // Multiple operators in sequence
+  assert(expr("3 + 4 - 5")->to_string() == "3 4 + 5 -");
+  assert(expr("6 * 7 / 2")->to_string() == "6 7 * 2 /");
+
+  // Invalid input should throw errors (commented out as assert does not catch
+  // exceptions) try { expr("+"); assert(false); } catch (...) {} // Unary +
+  // without operand try { expr("(3 + 4"); assert(false); } catch (...) {} //
+  // Mismatched parentheses try { expr(")3 + 4("); assert(false); } catch (...)
+  // {} // Invalid parentheses
+}
+
+void test_large_numbers() {
+  assert(expr("123 + 456")->to_string() == "123 456 +");
+  assert(expr("99999 * 88888")->to_string() == "99999 88888 *");
+  assert(expr("1234567890 - 987654321")->to_string() ==
+         "1234567890 987654321 -");
+}
+
+void test_no_operators() {
+  assert(expr("123")->to_string() == "123");
+  assert(expr("456 789")->to_string() == "456 789");
+}
+
+void test_postfix_operators() {
+  assert(expr("3!")->to_string() == "3 !");
+  assert(expr("(4 + 5)!")->to_string() == "4 5 + !");
+}
+
+void test_batch_strided() {
+  struct Row {
+    int a;
+    char tag;
+    int b;
+  };
+  Row rows[] = {{1, 'x', 2}, {3, 'y', 4}, {5, 'z', 6}};
+  int c[] = {10, 20, 30};
+  int out[3];
+
+  auto kernel = eval_batch(expr("a * b + c")->to_string(),
+                           {{"a", sizeof(Row), offsetof(Row, a)},
+                            {"b", sizeof(Row), offsetof(Row, b)},
+                            {"c", sizeof(int), 0}});
+  const void *bases[] = {rows, rows, c};
+  kernel(bases, out, 3);
+  assert(out[0] == 12 && out[1] == 32 && out[2] == 60);
+}
+
+void test_arrow() {
+  // a is a slice starting at element 3 of its buffers, with element 5 null
+  int a_values[] = {0, 0, 0, 1, 2, 3, 4};
+  uint8_t a_bitmap[] = {0xdf};
+  const void *a_buffers[] = {a_bitmap, a_values};
+  ArrowArray a = {4, 1, 3, 2, 0, a_buffers, nullptr, nullptr, nullptr, nullptr};
+  int b_values[] = {10, 20, 30, 40};
+  const void *b_buffers[] = {nullptr, b_values};
+  ArrowArray b = {4, 0, 0, 2, 0, b_buffers, nullptr, nullptr, nullptr, nullptr};
+  ArrowSchema int32 = {"i", "", nullptr, 0, 0, nullptr, nullptr, nullptr,
+                       nullptr};
+
+  auto kernel = eval_batch(expr("a + b")->to_string(),
+                           arrow_columns({"a", "b"}, {&int32, &int32}));
+  ArrowArray out;
+  ArrowSchema out_schema;
+  eval_arrow(kernel, {&a, &b}, {&int32, &int32}, &out, &out_schema);
+
+  auto *values = (const int *)out.buffers[1];
+  auto *validity = (const uint8_t *)out.buffers[0];
+  assert(out.length == 4 && out.null_count == 1);
+  assert(values[0] == 11 && values[1] == 22 && values[3] == 44);
+  assert(validity[0] == 0x0b);
+  out.release(&out);
+  out_schema.release(&out_schema);
+  assert(!out.release && !out_schema.release);
+
+  // the null element holds 0, and is never divided by: its row is skipped
+  // and the buffers are read where they are
+  a_values[5] = 0;
+  kernel = eval_batch(expr("b / a")->to_string(),
+                      arrow_columns({"b", "a"}, {&int32, &int32}));
+  eval_arrow(kernel, {&b, &a}, {&int32, &int32}, &out, &out_schema);
+  values = (const int *)out.buffers[1];
+  assert(values[0] == 10 && values[1] == 10 && values[2] == 0 &&
+         values[3] == 10 && out.null_count == 1);
+  out.release(&out);
+  // nulls in both inputs, at different offsets, across bytes
+  int c_values[20], d_values[21];
+  // c's rows 8 and 15 are null, and d's 11 and 19 (bits 12 and 20)
+  uint8_t c_bitmap[] = {0xff, 0x7e, 0xff}, d_bitmap[] = {0xfe, 0xef, 0xef};
+  for (int i = 0; i < 20; ++i)
+    c_values[i] = i + 1, d_values[i + 1] = i % 3 + 1;
+  const void *c_buffers[] = {c_bitmap, c_values},
+             *d_buffers[] = {d_bitmap, d_values};
+  ArrowArray c = {20, 2, 0, 2, 0, c_buffers, nullptr, nullptr, nullptr,
+                  nullptr};
+  ArrowArray d = {20, 2, 1, 2, 0, d_buffers, nullptr, nullptr, nullptr,
+                  nullptr};
+  c_values[8] = c_values[15] = 0;
+  d_values[12] = d_values[20] = 0;
+  kernel = eval_batch(expr("100 / c + 100 / d")->to_string(),
+                      arrow_columns({"c", "d"}, {&int32, &int32}));
+  eval_arrow(kernel, {&c, &d}, {&int32, &int32}, &out, &out_schema);
+  values = (const int *)out.buffers[1];
+  validity = (const uint8_t *)out.buffers[0];
+  assert(out.null_count == 4);
+  for (int i = 0; i < 20; ++i) {
+    bool null = i == 8 || i == 15 || i == 11 || i == 19;
+    assert((validity[i / 8] >> (i % 8) & 1) == !null);
+    assert(values[i] == (null ? 0 : 100 / (i + 1) + 100 / (i % 3 + 1)));
+  }
+  out.release(&out);
+  // a kernel that faults all the same raises a TrapError when it traps
+  int width;
+  vector<Column> columns = arrow_columns({"b", "a"}, {&int32, &int32});
+  auto trapping = eval_batch_trapping(expr("b / (a - 1)"), columns, &width);
+  bool trapped = false;
+  try {
+    eval_arrow(trapping, {&b, &a}, {&int32, &int32}, &out, &out_schema);
+  } catch (const TrapError &e) {
+    trapped = e.signal == SIGFPE;
+  }
+  assert(trapped);
+
+  ArrowSchema int64 = int32;
+  int64.format = "l";
+  bool threw = false;
+  try {
+    eval_arrow(kernel, {&b, &a}, {&int32, &int64}, &out, &out_schema);
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_jsonl() {
+  assert((rpn_variables("_id p * q _id + +") ==
+          vector<string>{"_id", "p", "q"}));
+
+  char path[] = "/tmp/jitxpr_jsonl_XXXXXX";
+  int fd = mkstemp(path);
+  string records;
+  for (int i = 0; i < 3000; ++i)
+    records += "{\"p\": " + std::to_string(i) +
+               ", \"note\": \"q\\\"p\", \"q\":" + std::to_string(i % 7 - 3) +
+               ".5}\n";
+  records += "\n{\"q\": 2, \"p\": {\"x\": 1}, \"p\": -4}";
+  assert(write(fd, records.data(), records.size()) == (ssize_t)records.size());
+  close(fd);
+
+  for (unsigned threads : {1u, 4u}) {
+    auto values = eval_jsonl(path, expr("p * q")->to_string(), nullptr, threads);
+    assert(values.size() == 3001);
+    for (int i = 0; i < 3000; ++i)
+      assert(values[i] == i * (i % 7 - 3));
+    assert(values[3000] == -8);
+  }
+  unlink(path);
+}
+
+void test_binary_round_trip() {
+  vector<string> inputs = {"3",         "1234567890 - 987654321",
+                           "(a + b) * c", "-3 * (4 + 2)",
+                           "(4 + 5)!",  "456 789",
+                           "a ? b : c", "x / y / 007"};
+  vector<shared_ptr<S>> exprs;
+  for (const auto &input : inputs)
+    exprs.push_back(expr(input));
+
+  string bytes = save_exprs(exprs);
+  auto loaded = load_exprs((const uint8_t *)bytes.data(), bytes.size());
+  assert(loaded.size() == exprs.size());
+  for (size_t i = 0; i < exprs.size(); ++i)
+    assert(loaded[i]->to_string() == exprs[i]->to_string());
+
+  char path[] = "/tmp/jitxpr_jxb_XXXXXX";
+  close(mkstemp(path));
+  save_exprs_file(path, exprs);
+  auto mapped = load_exprs_file(path);
+  auto rpns = load_rpns_file(path);
+  unlink(path);
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    assert(mapped[i]->to_string() == exprs[i]->to_string());
+    assert(rpns[i] == exprs[i]->to_string());
+  }
+
+  bool threw = false;
+  try {
+    load_exprs((const uint8_t *)bytes.data(), bytes.size() - 1);
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_identifiers() {
+  auto e = expr("rate * qty_2 + rate");
+  assert(e->to_string() == "rate qty_2 * rate +");
+  assert(e->rest[0]->rest[0]->sym == e->rest[1]->sym);
+  assert(symbols.name(e->rest[1]->sym) == "rate");
+  assert(symbols.find("qty_2") == e->rest[0]->rest[1]->sym);
+  assert(symbols.find("never_seen") < 0);
+
+  string bytes = save_exprs({e});
+  auto loaded = load_exprs((const uint8_t *)bytes.data(), bytes.size());
+  assert(loaded[0]->rest[1]->sym == e->rest[1]->sym);
+
+  // enough names to force the intern table to grow a few times
+  for (int i = 0; i < 1000; ++i)
+    assert(symbols.intern("v" + std::to_string(i)) ==
+           symbols.find("v" + std::to_string(i)));
+
+  int price[] = {3, 4}, qty[] = {5, 6}, out[2];
+  auto kernel = eval_batch(expr("price * qty - rate")->to_string(),
+                           {{"qty", sizeof(int), 0},
+                            {"price", sizeof(int), 0},
+                            {"rate", sizeof(int), 0}});
+  const void *bases[] = {qty, price, qty};
+  kernel(bases, out, 2);
+  assert(out[0] == 10 && out[1] == 18);
+}
+
+void test_parse_many() {
+  vector<string> inputs;
+  for (int i = 0; i < 5000; ++i)
+    inputs.push_back(i % 3   ? "(rate + " + std::to_string(i) + ") * qty"
+                     : i % 2 ? "a ? -b : c! 456 789"
+                             : "z * 3i + 2 - 10i");
+  vector<string_view> views(inputs.begin(), inputs.end());
+
+  for (unsigned threads : {1u, 3u}) {
+    auto arena = parse_many(views, threads);
+    assert(arena.size() == inputs.size());
+    for (ExprHandle h = 0; h < arena.size(); ++h) {
+      string rpn = expr(inputs[h])->to_string();
+      assert(arena.to_string(h) == rpn);
+      assert(arena.tree(h)->to_string() == rpn);
+    }
+  }
+
+  for (string_view bad : {"(1 + 2", "x / 007", "99999999999999999999 + 1",
+                          "z * 03i"}) {
+    views[4000] = bad;
+    bool threw = false;
+    try {
+      parse_many(views, 3);
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+}
+
+void test_vectors() {
+  struct Row {
+    int w[3];
+    int x[3];
+    int b;
+    int A[2][3];
+  };
+  Row rows[] = {{{1, 2, 3}, {4, 5, 6}, 7, {{1, 0, 0}, {1, 1, 1}}},
+                {{0, 1, 0}, {2, 2, 2}, -1, {{2, 0, 1}, {0, 3, 0}}}};
+  vector<Column> columns = {{"w", sizeof(Row), offsetof(Row, w), 3},
+                            {"x", sizeof(Row), offsetof(Row, x), 3},
+                            {"b", sizeof(Row), offsetof(Row, b)},
+                            {"A", sizeof(Row), offsetof(Row, A), 2, 3}};
+  const void *bases[] = {rows, rows, rows, rows};
+  int width;
+
+  assert(lower_shapes(expr("dot(w, x) + b"), columns, &width)->to_string() ==
+         "w@0 x@0 * w@1 x@1 * + w@2 x@2 * + b +");
+  int out[6];
+  eval_batch(expr("dot(w, x) + b"), columns, &width)(bases, out, 2);
+  assert(width == 1 && out[0] == 39 && out[1] == 1);
+
+  eval_batch(expr("A * x"), columns, &width)(bases, out, 2);
+  assert(width == 2 && out[0] == 4 && out[1] == 15 && out[2] == 6 &&
+         out[3] == 6);
+
+  eval_batch(expr("sum(w + 2 * x) - b"), columns, &width)(bases, out, 2);
+  assert(width == 1 && out[0] == 29 && out[1] == 14);
+
+  for (const char *bad : {"dot(w, A)", "A * w * b + x", "w ? 1 : 2"}) {
+    bool threw = false;
+    try {
+      lower_shapes(expr(bad), columns, &width);
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+}
+
+void test_bitwise() {
+  assert(expr("a | b & c << 2")->to_string() == "a b c 2 << & |");
+  assert(expr("a ^ b | c")->to_string() == "a b ^ c |");
+  assert(expr("x >> 3 + 1")->to_string() == "x 3 1 + >>");
+  assert(expr("~x & 255")->to_string() == "x ~ 255 &");
+  assert(expr("x >>> 28")->to_string() == "x 28 >>>");
+
+  int x[] = {0x1234, -16, 7}, k[] = {4, 2, 33};
+  int out[3];
+  auto kernel = eval_batch(expr("(x >> 4) & 255")->to_string(),
+                           {{"x", sizeof(int), 0}});
+  const void *bases[] = {x, k};
+  kernel(bases, out, 3);
+  assert(out[0] == 0x23 && out[1] == 255 && out[2] == 0);
+
+  kernel = eval_batch(expr("(x >> k) ^ (x >>> k) | ~x << 1")->to_string(),
+                      {{"x", sizeof(int), 0}, {"k", sizeof(int), 0}});
+  kernel(bases, out, 3);
+  for (int i = 0; i < 3; ++i)
+    assert(out[i] == (((x[i] >> (k[i] & 31)) ^
+                       int(unsigned(x[i]) >> (k[i] & 31))) |
+                      int(unsigned(~x[i]) << 1)));
+
+  // unary minus negates rather than subtracting from a stale slot
+  assert(expr("-x + 1")->to_string() == "x -- 1 +");
+  assert(expr("x * -1")->to_string() == "x 1 -- *");
+  int y[] = {-5, 3, 10};
+  const void *ys[] = {y};
+  for (const char *text : {"-x + 1", "x * -1", "+x - -x"}) {
+    kernel = eval_batch(expr(text)->to_string(), {{"x", sizeof(int), 0}});
+    kernel(ys, out, 3);
+    for (int i = 0; i < 3; ++i) {
+      int expected;
+      assert(eval_pure(*expr(text), symbols.find("x"), y[i], &expected) &&
+             out[i] == expected);
+    }
+  }
+  assert(out[0] == -10 && out[1] == 6 && out[2] == 20);
+
+  // an intermediate that overflows wraps before it is divided or shifted,
+  // whether the other operand is a literal or a column
+  assert(eval("65536 65536 * 2 /")() == 0);
+  int a[] = {INT32_MAX, -7, 65536}, b[] = {1, 3, 65536}, two[] = {2, 2, 2};
+  const void *operands[] = {a, b, two};
+  vector<Column> columns = {{"a", sizeof(int), 0},
+                            {"b", sizeof(int), 0},
+                            {"two", sizeof(int), 0}};
+  auto sum = [](int a, int b) { return int(unsigned(a) + unsigned(b)); };
+  auto product = [](int a, int b) { return int(unsigned(a) * unsigned(b)); };
+  pair<const char *, function<int(int, int)>> cases[] = {
+      {"(a + b) / 2", [&](int a, int b) { return sum(a, b) / 2; }},
+      {"(a + b) / two", [&](int a, int b) { return sum(a, b) / 2; }},
+      {"(a * b) / 2", [&](int a, int b) { return product(a, b) / 2; }},
+      {"(a * b) / two", [&](int a, int b) { return product(a, b) / 2; }},
+      {"(a + b) >> 1", [&](int a, int b) { return sum(a, b) >> 1; }},
+      {"two / (a * b + 1)",
+       [&](int a, int b) { return 2 / sum(product(a, b), 1); }}};
+  for (const auto &[text, expected] : cases) {
+    kernel = eval_batch(expr(text)->to_string(), columns);
+    kernel(operands, out, 3);
+    for (int i = 0; i < 3; ++i)
+      assert(out[i] == expected(a[i], b[i]));
+  }
+}
+
+void test_lookup_tables() {
+  assert(expr("bucket(x, [10, 20])")->to_string() == "x 10 20 [ bucket");
+  // an equal table is the same table
+  string once = lower_tables(expr("bucket(x, [10, 20])"))->to_string();
+  assert(lower_tables(expr("bucket(x, [10, 20])"))->to_string() == once);
+  assert(lower_tables(expr("bucket(x, [10, 21])"))->to_string() != once);
+  assert(lower_tables(expr("piecewise(x, [10, 20], [1, 2, 3])"))
+             ->to_string() != "x piecewise" + once.substr(once.find('#')));
+
+  int x[] = {-100, 9, 10, 15, 20, 99999};
+  int out[6];
+  const void *bases[] = {x};
+  vector<Column> columns = {{"x", sizeof(int), 0}};
+  int width;
+  auto kernel = eval_batch(expr("bucket(x, [10, 20]) * 2"), columns, &width);
+  kernel(bases, out, 6);
+  int buckets[] = {0, 0, 1, 1, 2, 2};
+  for (int i = 0; i < 6; ++i)
+    assert(out[i] == buckets[i] * 2);
+
+  kernel = eval_batch(expr("piecewise(x, [-5, 10, 20], [1, -2, 300, 4])"),
+                      columns, &width);
+  kernel(bases, out, 6);
+  int fees[] = {1, -2, 300, 300, 4, 4};
+  for (int i = 0; i < 6; ++i)
+    assert(out[i] == fees[i]);
+
+  // past SMALL_TABLE the edges are binary searched
+  string edges, values = "0";
+  vector<int> e;
+  for (int k = 0; k < 37; ++k) {
+    e.push_back(k * k - 50);
+    edges += (k ? ", " : "") + std::to_string(k * k - 50);
+    values += ", " + std::to_string((k + 1) * 7);
+  }
+  int many[200];
+  for (int i = 0; i < 200; ++i)
+    many[i] = i * 7 - 90;
+  const void *many_bases[] = {many};
+  int results[2][200];
+  kernel = eval_batch(expr("bucket(x, [" + edges + "])"), columns, &width);
+  kernel(many_bases, results[0], 200);
+  kernel = eval_batch(expr("piecewise(x, [" + edges + "], [" + values + "])"),
+                      columns, &width);
+  kernel(many_bases, results[1], 200);
+  for (int i = 0; i < 200; ++i) {
+    int b = upper_bound(e.begin(), e.end(), many[i]) - e.begin();
+    assert(results[0][i] == b && results[1][i] == b * 7);
+  }
+
+  bool threw = false;
+  try {
+    lower_tables(expr("bucket(x, [20, 10])"));
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_tabulate() {
+  vector<Column> columns = {{"x", sizeof(int), 0}, {"y", sizeof(int), 0}};
+  auto f = [](int x) { return (x * x * x - 7 * x) / (x * x + 1); };
+  int x[] = {-50, -3, 0, 1, 77, 200, -1000, 5000}, y[8] = {1, 2, 3};
+  int out[8], width;
+  const void *bases[] = {x, y};
+
+  TabulateOptions options;
+  options.ranges = {{"x", -50, 200}};
+  TabulateStats stats;
+  auto e = tabulate(expr("(x * x * x - 7 * x) / (x * x + 1) + y"), options,
+                    &stats);
+  assert(stats.tables == 1 && stats.max_error == 0);
+  eval_batch(e, columns, &width)(bases, out, 8);
+  for (int i = 0; i < 6; ++i)
+    assert(out[i] == f(x[i]) + y[i]);
+  assert(out[6] == f(-50) && out[7] == f(200));
+
+  // interpolated between every 2^shift-th sample within the bound
+  options.ranges = {{"x", 0, 1000}};
+  options.max_error = 3;
+  stats = {};
+  e = tabulate(expr("x * x / 16 + x * 3 / 7"), options, &stats);
+  assert(stats.tables == 1 && stats.max_error <= 3 && stats.bytes < 1000);
+  int all[1001];
+  for (int i = 0; i <= 1000; ++i)
+    all[i] = i;
+  const void *all_bases[] = {all, y};
+  int results[1001];
+  eval_batch(e, columns, &width)(all_bases, results, 1001);
+  for (int i = 0; i <= 1000; ++i)
+    assert(abs(results[i] - (i * i / 16 + i * 3 / 7)) <= 3);
+
+  // a division by zero inside the range keeps the code as it is
+  options.ranges = {{"x", -5, 5}};
+  stats = {};
+  tabulate(expr("1000 / x * x * x / 3"), options, &stats);
+  assert(stats.tables == 0);
+}
+
+static int host_calls, host_blocks;
+int test_curve(int t) { return ++host_calls, t * t + 1; }
+int test_clamp(int v, int lo, int hi) { return v < lo ? lo : v > hi ? hi : v; }
+int test_tick() { return ++host_calls; }
+int test_square(int v) { return ++host_calls, v * v; }
+void test_squares(const int *const *args, int *out, int n) {
+  ++host_blocks;
+  for (int i = 0; i < n; ++i)
+    out[i] = args[0][i] * args[0][i];
+}
+
+void test_host_functions() {
+  register_function("curve", test_curve, HOST_PURE | HOST_EXPENSIVE);
+  register_function("clamp3", test_clamp, HOST_CONST | HOST_CHEAP);
+  register_function("tick", test_tick);
+  register_function("square", test_square, HOST_PURE, test_squares);
+  assert(expr("clamp3(x, 0, 9)")->to_string() == "x 0 9 clamp3");
+
+  int x[200], out[200], width;
+  for (int i = 0; i < 200; ++i)
+    x[i] = i - 100;
+  const void *bases[] = {x};
+  vector<Column> columns = {{"x", sizeof(int), 0}};
+  auto run = [&](const string &line) {
+    host_calls = host_blocks = 0;
+    eval_batch(expr(line), columns, &width)(bases, out, 200);
+  };
+
+  // repeated pure calls are shared within a row
+  run("curve(x) + clamp3(curve(x), 0, 5000) * 2");
+  for (int i = 0; i < 200; ++i)
+    assert(out[i] == x[i] * x[i] + 1 + 2 * min(x[i] * x[i] + 1, 5000));
+  assert(host_calls == 200);
+
+  // pure calls on constants run once per kernel call, impure ones per row
+  run("x * curve(7) + tick() - tick()");
+  assert(out[5] == -95 * 50 - 1 && host_calls == 1 + 400);
+
+  // the vectorised variant runs once per block, even nested
+  run("square(square(x) - 3) + x");
+  for (int i = 0; i < 200; ++i)
+    assert(out[i] == (x[i] * x[i] - 3) * (x[i] * x[i] - 3) + x[i]);
+  assert(host_calls == 0 && host_blocks == 2 * 4);
+
+  // an impure one is called per row, each call its own
+  register_function("square", test_square, 0, test_squares);
+  run("square(x) + square(x)");
+  for (int i = 0; i < 200; ++i)
+    assert(out[i] == 2 * x[i] * x[i]);
+  assert(host_calls == 400 && host_blocks == 0);
+  register_function("square", test_square, HOST_PURE, test_squares);
+
+  // const functions are evaluated at compile time by tabulate()
+  TabulateOptions options;
+  options.ranges = {{"x", -100, 99}};
+  TabulateStats stats;
+  auto e = tabulate(expr("clamp3(x * x * x / 7, -1000, 1000) / 3"), options,
+                    &stats);
+  assert(stats.tables == 1);
+  eval_batch(e, columns, &width)(bases, out, 200);
+  for (int i = 0; i < 200; ++i)
+    assert(out[i] == test_clamp(x[i] * x[i] * x[i] / 7, -1000, 1000) / 3);
+
+  assert(eval(expr("curve(3) * curve(3)")->to_string())() == 100);
+}
+
+// balanced sum of leaves[lo, hi) with alternating signs, fully bracketed
+// every fourth leaf times the next of names, when there are names
+string balanced_formula(const vector<int> &leaves, size_t lo, size_t hi,
+                        const vector<string> &names = {}) {
+  if (hi - lo == 1) {
+    if (names.empty() || lo % 4)
+      return std::to_string(leaves[lo]);
+    return "(" + names[lo / 4 % names.size()] + " * " +
+           std::to_string(leaves[lo]) + ")";
+  }
+  size_t mid = (lo + hi) / 2;
+  return "(" + balanced_formula(leaves, lo, mid, names) +
+         (lo % 2 ? " - " : " + ") + balanced_formula(leaves, mid, hi, names) +
+         ")";
+}
+
+void test_fragments() {
+  vector<int> leaves(1024);
+  for (size_t i = 0; i < leaves.size(); ++i)
+    leaves[i] = i * 37 % 101;
+  auto value = [](pbatch f) {
+    int v;
+    f(nullptr, &v, 1);
+    return v;
+  };
+  FragmentCache cache;
+  string formula = balanced_formula(leaves, 0, leaves.size());
+  pbatch f = cache.compile(expr(formula));
+  assert(value(f) == eval(expr(formula)->to_string())());
+  assert(cache.last().compiled >= 16 && cache.last().reused == 0);
+
+  // one edited leaf regenerates only the fragments above it
+  leaves[600] += 5;
+  formula = balanced_formula(leaves, 0, leaves.size());
+  f = cache.compile(expr(formula));
+  assert(value(f) == eval(expr(formula)->to_string())());
+  assert(cache.last().compiled <= 6 && cache.last().reused > 0);
+
+  f = cache.compile(expr(formula));
+  assert(cache.last().compiled == 0);
+
+  // past capacity the rpns of older compiles go, and with them the code
+  // only they called
+  FragmentCache small({}, 8);
+  small.compile(expr(formula));
+  size_t before = small.size(), slots = fragment_code.size();
+  for (int edit = 0; edit < 4; ++edit) {
+    for (auto &leaf : leaves)
+      leaf += 1;
+    formula = balanced_formula(leaves, 0, leaves.size());
+    f = small.compile(expr(formula));
+    assert(value(f) == eval(expr(formula)->to_string())());
+    assert(small.size() <= small.last().compiled + small.last().reused &&
+           small.size() < before + small.last().compiled);
+    assert(small.live() <= small.last().compiled + small.last().reused);
+  }
+  assert(fragment_code.size() <= slots + small.last().compiled);
+
+  // with columns each fragment evaluates the row it is called for
+  int a[] = {3, -4, 1000, 65536}, b[] = {5, 0, -7, 65536};
+  const void *bases[] = {a, b};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  FragmentCache rows(columns);
+  auto check = [&](pbatch f) {
+    int got[4], want[4];
+    f(bases, got, 4);
+    eval_batch(expr(formula)->to_string(), columns)(bases, want, 4);
+    for (int i = 0; i < 4; ++i)
+      assert(got[i] == want[i]);
+  };
+  formula = balanced_formula(leaves, 0, leaves.size(), {"a", "b"});
+  check(rows.compile(expr(formula)));
+  assert(rows.last().compiled >= 16);
+  leaves[600] += 5; // a term of a
+  formula = balanced_formula(leaves, 0, leaves.size(), {"a", "b"});
+  check(rows.compile(expr(formula)));
+  assert(rows.last().compiled <= 6 && rows.last().reused > 0);
+
+  bool threw = false;
+  try {
+    rows.compile(expr("x + " + formula));
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+static char crash_marker[] = "/tmp/jitxpr_crashed_XXXXXX";
+int test_crash_once(int v) {
+  // the marker outlives the worker, so only the first attempt crashes
+  if (v == 777 && access(crash_marker, F_OK) != 0) {
+    close(open(crash_marker, O_CREAT | O_WRONLY, 0644));
+    abort();
+  }
+  return v;
+}
+
+void test_forked() {
+  register_function("crash_once", test_crash_once);
+  vector<int> a(10000), b(10000);
+  for (int i = 0; i < 10000; ++i)
+    a[i] = i, b[i] = i % 13;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  char path[] = "/tmp/jitxpr_fork_XXXXXX";
+  close(mkstemp(path));
+  // a fresh name, left absent until the first crash
+  close(mkstemp(crash_marker));
+  unlink(crash_marker);
+
+  ForkStats stats;
+  int width;
+  auto out = eval_forked(eval_batch(expr("crash_once(a) * 3 + b"), columns,
+                                    &width),
+                         columns, bases, 10000, path, 1, 4, 2, &stats);
+  for (int i = 0; i < 10000; ++i)
+    assert(out.get()[i] == i * 3 + i % 13);
+  assert(stats.restarts == 1);
+  unlink(crash_marker);
+
+  // a shard that fails every time is reported, the caller survives
+  bool threw = false;
+  try {
+    eval_forked(eval_batch(expr("a / (b - 5)"), columns, &width), columns,
+                bases, 10000, path, 1, 4, 1);
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+
+  // grid axes have no buffer; each shard starts its own sample index
+  vector<Column> grid = {{"x", 1, 0}, {"y", 0, 0}, {"a", sizeof(int), 0}};
+  grid[0].lo = 0, grid[0].hi = 9999, grid[0].samples = 10000;
+  grid[1].lo = -50, grid[1].hi = 50, grid[1].samples = 11;
+  int first_x = 0, fixed_y = 3;
+  const void *grid_bases[] = {&first_x, &fixed_y, a.data()};
+  out = eval_forked(eval_batch(expr("x * 100 + y - a"), grid, &width), grid,
+                    grid_bases, 10000, path, 1, 4);
+  for (int i = 0; i < 10000; ++i)
+    assert(out.get()[i] == i * 100 - 20 - i);
+  unlink(path);
+}
+
+void test_memo() {
+  vector<Column> columns = {{"x", sizeof(int), 0}, {"y", sizeof(int), 0}};
+  int width;
+  MemoTable memo(eval_batch(expr("x * x / (y + 1)"), columns, &width), 2);
+  for (int round = 0; round < 3; ++round)
+    for (int x = 0; x < 50; ++x) {
+      int args[] = {x, x % 3};
+      assert(memo(args) == x * x / (x % 3 + 1));
+    }
+  auto stats = memo.stats();
+  assert(stats.hits >= 90 && stats.hits + stats.misses == 150);
+
+  // concurrent callers see only whole entries
+  vector<thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&memo, t] {
+      for (int i = 0; i < 20000; ++i) {
+        int args[] = {(i * 7 + t) % 300, i % 5};
+        assert(memo(args) == args[0] * args[0] / (args[1] + 1));
+      }
+    });
+  for (auto &t : threads)
+    t.join();
+
+  // inputs that never repeat switch the table off
+  for (int i = 0; i < 3 * int(MemoTable::WINDOW); ++i) {
+    int args[] = {i, 1};
+    assert(memo(args) == i * i / 2);
+  }
+  stats = memo.stats();
+  assert(!stats.enabled && stats.bypassed > 0);
+}
+
+void test_optimize_size() {
+  int x[] = {-100, 3, 9, 10, 15, 20, 41, 99999};
+  int y[] = {1, 2, 3, 4, 5, 6, 7, 8};
+  int out[2][8];
+  const void *bases[] = {x, y};
+  vector<Column> columns = {{"x", sizeof(int), 0}, {"y", sizeof(int), 0}};
+  int width;
+  auto rule = expr("piecewise(x, [0, 5, 10, 20, 40], [7, 1, 2, 3, 4, 5]) * y"
+                   " + bucket(y, [2, 4, 6])");
+  size_t bytes[2];
+  for (int small = 0; small < 2; ++small) {
+    optimize_size = small;
+    size_t before = code_bytes;
+    eval_batch(rule, columns, &width)(bases, out[small], 8);
+    bytes[small] = code_bytes - before;
+  }
+  optimize_size = false;
+  assert(bytes[1] < bytes[0]);
+  for (int i = 0; i < 8; ++i)
+    assert(out[0][i] == out[1][i]);
+  assert(out[1][0] == 7 * 1 + 0 && out[1][7] == 5 * 8 + 3);
+}
+
+void test_canonicalize() {
+  auto rpn = [](const string &s) { return canonicalize(expr(s))->to_string(); };
+  assert(rpn("3 + x + 4") == "x 7 +");
+  assert(rpn("a + b") == rpn("b + a"));
+  assert(rpn("2 * y * 3 * x") == "x y * 6 *");
+  assert(rpn("a + b + c + d") == "a b + c d + +");
+  assert(rpn("(b + a) * (a + b) - 0 - x * 1") == "a b + a b + * 0 - x -");
+  assert(rpn("2 + 3 * 4") == "14");
+  // a constant that wraps negative stays as literals
+  assert(rpn("x + 2147483647 + 1") == "1 2147483647 x + +");
+  register_function("tick", test_tick);
+  assert(rpn("b + tick() + a") == "b tick a + +");
+
+  int a[] = {1, -7, 2147483647, 40000}, b[] = {5, 3, 1, 70000};
+  const void *bases[] = {a, b};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  int width, out[2][4];
+  string text = "3 * a * 5 + b * a + 11 + a * b * 2 - (b + a + 1) * 4";
+  eval_batch(expr(text)->to_string(), columns)(bases, out[0], 4);
+  eval_batch(expr(text), columns, &width)(bases, out[1], 4);
+  for (int i = 0; i < 4; ++i)
+    assert(out[0][i] == out[1][i]);
+}
+
+void test_grid() {
+  // sample j of [lo, hi] in n samples, rounded toward lo
+  auto sample = [](int lo, int hi, int n, int j) {
+    int64_t span = abs(int64_t(hi) - lo), m = max(n - 1, 1);
+    return int(lo + (hi < lo ? -1 : 1) * (span * j / m));
+  };
+  vector<GridAxis> axes = {{"x", 0, 10, 6}, {"y", -3, 3, 4}, {"z", 10, 0, 4}};
+  auto out = eval_grid(expr("x * y + x - z"), axes, 3);
+  assert(out.size() == 6 * 4 * 4);
+  for (int k = 0; k < 4; ++k)
+    for (int j = 0; j < 4; ++j)
+      for (int i = 0; i < 6; ++i) {
+        int x = i * 2, y = j * 2 - 3, z = sample(10, 0, 4, k);
+        assert(out[i + 6 * (j + 4 * k)] == x * y + x - z);
+      }
+
+  // steps that are not whole go through fixed point
+  vector<GridAxis> odd = {{"x", 0, 100, 7},
+                          {"x", -5, 2000000, 65536},
+                          {"x", 7, -2147483647, 1000},
+                          {"x", 3, 9, 1}};
+  for (const GridAxis &a : odd) {
+    out = eval_grid(expr("x"), {a});
+    for (int i = 0; i < a.samples; ++i)
+      assert(out[i] == sample(a.lo, a.hi, a.samples, i));
+    assert(a.samples == 1 || out.back() == a.hi);
+  }
+
+  bool threw = false;
+  try {
+    eval_grid(expr("x"), {{"x", 0, 1, 0}});
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_shapes() {
+  assert(shape_library().size() == 1 + 3 * 4 + 7 * 2 * 16);
+  assert(shape_library().count("v c v - *"));
+
+  struct Row {
+    int a, pad, b, c;
+  };
+  Row rows[5] = {{1, 0, 2, 3}, {-4, 0, 5, 7}, {100, 0, 3, 1},
+                 {7, 0, -9, 2}, {2147483647, 0, 1, 5}};
+  const void *bases[] = {rows, rows, rows};
+  vector<Column> columns = {{"a", sizeof(Row), offsetof(Row, a)},
+                            {"b", sizeof(Row), offsetof(Row, b)},
+                            {"c", sizeof(Row), offsetof(Row, c)}};
+  ShapeStats stats;
+  for (string f : {"a * b + c", "(a - b) / c", "3 + a + 4", "a * 7 - c",
+                   "100 / (c + a * 0)", "a / 2 * b", "a", "a * a + b",
+                   "a & b", "a + b + c + a", "a * b * c * 2",
+                   "(a + b) / 2", "(a + b) / c"}) {
+    // the same ints as the generated code with and without the passes
+    int width, want[5], unoptimized[5], got[5];
+    eval_batch(expr(f), columns, &width)(bases, want, 5);
+    eval_batch(expr(f), columns, &width, 0)(bases, unoptimized, 5);
+    batch_kernel(expr(f), columns, &stats)(bases, got, 5);
+    for (int i = 0; i < 5; ++i)
+      assert(got[i] == want[i] && got[i] == unoptimized[i]);
+  }
+  assert(stats.hits == 9 && stats.misses == 4);
+  // INT32_MAX + 1 wraps before the division, as it does in an int
+  int got[5];
+  batch_kernel(expr("(a + b) / 2"), columns, &stats)(bases, got, 5);
+  assert(got[4] == -1073741824);
+  batch_kernel(expr("(a + b) / c"), columns, &stats)(bases, got, 5);
+  assert(got[4] == -429496729);
+}
+
+void test_passes() {
+  auto at = [](const string &f, int level, vector<VarRange> ranges = {}) {
+    return passes().run(lower_tables(expr(f)), level, ranges)->to_string();
+  };
+  assert(at("x * 1 + 0 + 3 * 4", 0) == "x 1 * 0 + 3 4 * +");
+  assert(at("x * 1 + 0 + 3 * 4", 1) == "x 12 +");
+  assert(at("(x - x) + ~~y * (z ^ 0)", 1) == "y z *");
+  assert(at("2 + x + 3", 1) == "2 x + 3 +");
+  assert(at("2 + x + 3", 2) == "x 5 +");
+  assert(at("(a * b + c) * (c + b * a)", 2) == "a b * c + tee#0 tmp#0 *");
+  assert(at("(x & 255) >> 8", 2) == "x 255 & 8 >>");
+  assert(at("(x & 255) >> 8", 3) == "0");
+  assert(at("(x & 255) + y", 3, {{"x", 0, 100}}) == "x y +");
+  assert(at("bucket(x, [10, 20]) * y", 3, {{"x", 10, 19}}) == "y");
+
+  // calls keep their arguments to themselves
+  register_function("square", test_square, HOST_PURE, test_squares);
+  assert(at("square(a * b + c) + (a * b + c)", 2) ==
+         "a b * a b * c + square c + +");
+
+  int a[] = {3, -4, 1000, 7}, b[] = {5, 6, -7, 8}, c[] = {0, 9, 2, -1};
+  const void *bases[] = {a, b, c};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0},
+                            {"c", sizeof(int), 0}};
+  passes().reset_stats();
+  string f = "(a * b + c) * (c + b * a) - square(a + 1) * (1 + a) * 1 + "
+             "(a - a) * c + ((c & 255) >> 8)";
+  int width, out[4][4];
+  for (int level = 0; level <= 3; ++level)
+    eval_batch(expr(f), columns, &width, level)(bases, out[level], 4);
+  for (int level = 1; level <= 3; ++level)
+    for (int i = 0; i < 4; ++i)
+      assert(out[level][i] == out[0][i]);
+  vector<string> names;
+  for (const auto &pass : passes().stats()) {
+    assert(pass.runs == size_t(4 - pass.level));
+    if (pass.name == "cse" || pass.name == "ranges")
+      assert(pass.changes > 0);
+    names.push_back(pass.name);
+  }
+  sort(names.begin(), names.end());
+  assert(adjacent_find(names.begin(), names.end()) == names.end());
+
+  // folded or not, an overflowing intermediate wraps at every level
+  string overflow = "65536 * 65536 / 2 + (a * 65536 * 65536) / 3 + "
+                    "(2147483647 + 1) / 2 + ((a + 2147483647) >> 1) + "
+                    "(a + 2147483647) / (1 + 1)";
+  for (int level = 0; level <= 3; ++level) {
+    eval_batch(expr(overflow), columns, &width, level)(bases, out[level], 4);
+    assert(eval(optimize(expr("65536 * 65536 / 2 + (2147483647 + 1) / 2"),
+                         level)
+                    ->to_string())() == -1073741824);
+  }
+  for (int i = 0; i < 4; ++i) {
+    int sum = unsigned(a[i]) + 2147483647u;
+    int expected = int(unsigned(-1073741824) + unsigned(sum >> 1) +
+                       unsigned(sum / 2));
+    for (int level = 0; level <= 3; ++level)
+      assert(out[level][i] == expected);
+  }
+}
+
+void test_complex() {
+  assert(expr("2 + 3i")->to_string() == "2 3i +");
+  assert(expr("3in")->to_string() == "3 in");
+
+  struct Row {
+    int z[2], w[2], x, y, v[4];
+  };
+  Row rows[4] = {{{1, 2}, {3, -4}, 5, 6, {1, 1, 2, 2}},
+                 {{-7, 0}, {0, 2}, -1, 0, {0, 0, 0, 0}},
+                 {{100, -50}, {-3, -3}, 0, 9, {5, -6, 7, 8}},
+                 {{0, 0}, {1, 1}, 12, -13, {-1, 2, -3, 4}}};
+  vector<Column> columns = {{"z", sizeof(Row), offsetof(Row, z)},
+                            {"w", sizeof(Row), offsetof(Row, w)},
+                            {"x", sizeof(Row), offsetof(Row, x)},
+                            {"y", sizeof(Row), offsetof(Row, y)},
+                            {"v", sizeof(Row), offsetof(Row, v), 2, 1}};
+  columns[0].complex = columns[1].complex = columns[4].complex = true;
+  const void *bases[] = {rows, rows, rows, rows, rows};
+  auto run = [&](const string &f, int want_width) {
+    int width;
+    vector<int> out(4 * want_width);
+    eval_batch(expr(f), columns, &width)(bases, out.data(), 4);
+    assert(width == want_width);
+    return out;
+  };
+
+  auto out = run("z * w - conj(z) * 3i + 2", 2);
+  for (int i = 0; i < 4; ++i) {
+    int a = rows[i].z[0], b = rows[i].z[1], c = rows[i].w[0], d = rows[i].w[1];
+    // (a - bi) * 3i = 3b + 3ai
+    assert(out[2 * i] == a * c - b * d - 3 * b + 2);
+    assert(out[2 * i + 1] == a * d + b * c - 3 * a);
+  }
+  out = run("(z * w) / w", 2);
+  for (int i = 0; i < 4; ++i)
+    assert(out[2 * i] == rows[i].z[0] && out[2 * i + 1] == rows[i].z[1]);
+  out = run("norm(z) + re(w) * im(z) - abs(w)", 1);
+  for (int i = 0; i < 4; ++i) {
+    int a = rows[i].z[0], b = rows[i].z[1], c = rows[i].w[0], d = rows[i].w[1];
+    assert(out[i] == a * a + b * b + c * b - isqrt(c * c + d * d));
+  }
+  // real operands, which never reach the host
+  out = run("abs(x) + abs(y) * 2 + re(x) + im(y) + norm(y) - conj(x)", 1);
+  for (int i = 0; i < 4; ++i) {
+    int x = rows[i].x, y = rows[i].y;
+    assert(out[i] == abs(x) + abs(y) * 2 + y * y);
+  }
+  out = run("arg(x + y * 1i)", 1);
+  for (int i = 0; i < 4; ++i)
+    assert(out[i] == iatan2(rows[i].y, rows[i].x));
+  // a complex vector: two interleaved elements per row
+  out = run("sum(v) * 2 + dot(v, v)", 2);
+  for (int i = 0; i < 4; ++i) {
+    const int *v = rows[i].v;
+    assert(out[2 * i] == 2 * (v[0] + v[2]) + v[0] * v[0] - v[1] * v[1] +
+                             v[2] * v[2] - v[3] * v[3]);
+    assert(out[2 * i + 1] == 2 * (v[1] + v[3]) + 2 * v[0] * v[1] +
+                                 2 * v[2] * v[3]);
+  }
+
+  for (string bad : {"z & 1", "conj(z, w)", "z >> 2"}) {
+    bool threw = false;
+    try {
+      run(bad, 2);
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+  // outside a batch there is nothing to make 3i complex
+  bool threw = false;
+  try {
+    optimize(expr("2 + 3i"));
+  } catch (const runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+// recurses until the stack runs out unless v is 0
+int test_deep(int v) {
+  volatile char frame[512];
+  frame[0] = char(v);
+  return v ? test_deep(v + 1) + frame[0] : 0;
+}
+
+void test_traps() {
+  const int n = 1000;
+  auto a = guarded_array(n), b = guarded_array(n);
+  for (int i = 0; i < n; ++i)
+    a.get()[i] = i * 3, b.get()[i] = i % 7 + 1;
+  const void *bases[] = {a.get(), b.get()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  vector<int> out(n + 1);
+  int width;
+  auto kernel = eval_batch_trapping(expr("a / b"), columns, &width);
+  kernel(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == i * 3 / (i % 7 + 1));
+
+  auto fault = [&](const TrappingKernel &k, int rows) {
+    try {
+      k(bases, out.data(), rows);
+    } catch (const TrapError &e) {
+      assert(string(e.what()).find("a b") != string::npos);
+      return e;
+    }
+    assert(false);
+    return TrapError("", 0, nullptr, false);
+  };
+  // one row past the end reads the guard page
+  TrapError e = fault(kernel, n + 1);
+  assert(e.signal == SIGSEGV && e.guard);
+  assert(e.address == a.get() + n || e.address == b.get() + n);
+
+  b.get()[500] = 0;
+  for (int round = 0; round < 2; ++round) {
+    e = fault(kernel, n);
+    assert(e.signal == SIGFPE && !e.guard);
+  }
+  // and the kernel runs on once the input is fixed
+  b.get()[500] = 1;
+  kernel(bases, out.data(), n);
+  assert(out[500] == 1500);
+
+  // a stack overflow in a host function is handled on the handler's stack
+  register_function("deep", test_deep);
+  auto deep = eval_batch_trapping(expr("deep(a) + b"), columns, &width);
+  bool overflowed = false;
+  try {
+    deep(bases, out.data(), 2);
+  } catch (const TrapError &e) {
+    overflowed = e.signal == SIGSEGV && !e.guard;
+  }
+  assert(overflowed);
+  deep(bases, out.data(), 1);
+  assert(out[0] == 1);
+}
+
+int test_version_one(int x) { return x; }
+int test_version_two(int x) { return -x; }
+
+void test_code_heap() {
+  CodeHeap heap;
+  const int n = 400;
+  auto value = [](int k) { return k * 7 - 3; };
+  vector<int> ids;
+  for (int k = 0; k < n; ++k)
+    ids.push_back(heap.add(expr(std::to_string(k) + " * 7 - 3")->to_string()));
+  vector<Column> columns = {{"a", sizeof(int), 0}};
+  int batch = heap.add(expr("a * a + 1")->to_string(), columns, 1);
+  for (int k = 0; k < n; ++k)
+    assert(heap.call(ids[k]) == value(k));
+  for (int k = 0; k < n; ++k)
+    if (k % 4)
+      heap.evict(ids[k]);
+  auto before = heap.stats();
+  assert(before.functions == n / 4 + 1 && before.fragmentation > 0.5);
+
+  // callers keep going while the heap is compacted under them
+  atomic<bool> done{false};
+  atomic<long> calls{0};
+  vector<thread> callers;
+  for (int t = 0; t < 3; ++t)
+    callers.emplace_back([&, t] {
+      int a[] = {t, t + 1}, out[2];
+      const void *bases[] = {a};
+      while (!done) {
+        for (int k = 0; k < n; k += 4)
+          assert(heap.call(ids[k]) == value(k));
+        CodeHeap::Pin pin(heap);
+        heap.batch(batch)(bases, out, 2);
+        assert(out[0] == t * t + 1 && out[1] == (t + 1) * (t + 1) + 1);
+        ++calls;
+      }
+    });
+  for (int round = 0; round < 3; ++round) {
+    long seen = calls;
+    while (calls < seen + 2)
+      this_thread::yield();
+    heap.compact();
+  }
+  done = true;
+  for (auto &t : callers)
+    t.join();
+  heap.reclaim();
+  auto after = heap.stats();
+  assert(after.functions == before.functions && after.fragmentation == 0);
+  assert(after.regions <= before.regions && after.mapped <= before.mapped);
+  for (int k = 0; k < n; ++k)
+    if (k % 4 == 0)
+      assert(heap.call(ids[k]) == value(k));
+  try {
+    heap.call(ids[1]);
+    assert(false);
+  } catch (const runtime_error &) {
+  }
+
+  // old code stays mapped while a thread that could be running it is pinned
+  {
+    CodeHeap::Pin pin(heap);
+    heap.compact();
+    assert(heap.stats().mapped > after.mapped);
+  }
+  heap.reclaim();
+  assert(heap.stats().mapped == after.mapped);
+
+  // compact() generates code as add() did: with the functions registered
+  // then and the optimize_size of the thread that added it
+  register_function("heap_version", test_version_one);
+  int versioned = heap.add(expr("heap_version(4) + 1")->to_string());
+  register_function("heap_version", test_version_two);
+  heap.compact();
+  assert(heap.call(versioned) == 5);
+  CodeHeap sized;
+  string edges;
+  for (int k = 0; k < 20; ++k)
+    edges += (k ? ", " : "") + std::to_string(k * 10);
+  optimize_size = true;
+  sized.add(lower_tables(expr("bucket(a, [" + edges + "])"))->to_string(),
+            columns, 1);
+  optimize_size = false;
+  size_t live = sized.stats().live;
+  sized.compact();
+  assert(sized.stats().live == live);
+}
+
+void test_profile() {
+  const int n = 1000;
+  vector<int> a(n), b(n);
+  for (int i = 0; i < n; ++i)
+    a[i] = i % 10 ? 0 : i % 100, b[i] = i % 50;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  vector<int> out(n);
+  int width;
+  auto expected = [&](int i) {
+    return a[i] ? b[i] / a[i] + 1 : (b[i] & 63) + 7;
+  };
+
+  // only the arm taken runs, so a == 0 never divides
+  auto lazy = eval_batch(expr("a ? b / a + 1 : (b & 63) + 7"), columns, &width);
+  lazy(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == expected(i));
+  assert(eval(optimize(expr("0 ? 1 / 0 : 2 ? 5 : 6"))->to_string())() == 5);
+  // a condition that overflows to 0 is false
+  int x[] = {65536, 3};
+  const void *xs[] = {x};
+  eval_batch(expr("(x * 65536) ? 1 : 2"), {{"x", sizeof(int), 0}}, &width)(
+      xs, out.data(), 2);
+  assert(out[0] == 2 && out[1] == 1);
+
+  Profile profile;
+  auto e = expr("a ? b / a + 1 : (b & 63) + 7");
+  auto profiling = eval_batch_profiling(e, columns, &width, profile);
+  profiling(bases, out.data(), n / 2);
+  profiling(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == expected(i));
+  const Profile::Entry &entry = *profile.find(e);
+  assert(entry.calls == 2 && entry.rows == n + n / 2);
+  uint64_t taken = 0, nonzero = 0;
+  for (int i = 0; i < n; ++i)
+    taken += a[i] != 0, nonzero += expected(i) != 0;
+  nonzero += nonzero / 2;
+  assert(entry.nonzero == nonzero && entry.selectivity() == 1);
+  assert(entry.branches.size() == 1);
+  auto branch = entry.branches.begin()->second;
+  assert(branch.taken == taken + taken / 2 &&
+         branch.taken + branch.not_taken == entry.rows);
+  assert(entry.ranges.size() == 2 && entry.ranges[0].name == "a" &&
+         entry.ranges[0].lo == 0 && entry.ranges[0].hi == 90 &&
+         entry.ranges[1].lo == 0 && entry.ranges[1].hi == 49);
+
+  char path[] = "/tmp/profileXXXXXX";
+  close(mkstemp(path));
+  profile.save(path);
+  Profile loaded = Profile::load(path);
+  const Profile::Entry &again = *loaded.find(e);
+  assert(loaded.entries.size() == 1 && again.calls == 2 &&
+         again.rows == entry.rows && again.nonzero == entry.nonzero &&
+         again.branches.begin()->first == entry.branches.begin()->first &&
+         again.branches.begin()->second.taken == branch.taken &&
+         again.ranges[1].name == "b" && again.ranges[1].hi == 49);
+  // every line stands on its own: a short or empty one is an error
+  for (const char *bad : {"expr 1 2 3 a b +\n\n", "expr 1 2\n",
+                          "expr 1 2 3 a\nrange 0 5\n", "range 0 5 a\n",
+                          "expr 1 2 3 a\nbranch x 1 a\n"}) {
+    FILE *f = fopen(path, "w");
+    fputs(bad, f);
+    fclose(f);
+    bool threw = false;
+    try {
+      Profile::load(path);
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+  unlink(path);
+
+  // the likely arm comes first, and b's range makes the mask redundant
+  auto pgo = eval_batch_pgo(e, columns, &width, loaded);
+  assert(pgo.rpn.find("unless#0") != string::npos && pgo.specialised());
+  pgo(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == expected(i));
+  b[7] = 1000; // outside the profile: the general kernel runs
+  pgo(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == expected(i));
+
+  // an expression the profile never saw is generated for size
+  auto cold = eval_batch_pgo(expr("a * 3 + b"), columns, &width, loaded);
+  assert(!cold.specialised() && !optimize_size);
+  cold(bases, out.data(), n);
+  for (int i = 0; i < n; ++i)
+    assert(out[i] == a[i] * 3 + b[i]);
+
+  // threads profile and build at once, each with its own counters and
+  // size setting
+  vector<thread> builders;
+  for (int t = 0; t < 4; ++t)
+    builders.emplace_back([&, t] {
+      Profile mine;
+      int w;
+      vector<int> got(n);
+      eval_batch_profiling(e, columns, &w, mine)(bases, got.data(), n);
+      assert(mine.find(e)->branches.begin()->second.taken == taken);
+      auto built = eval_batch_pgo(t % 2 ? e : expr("a * 3 + b"), columns, &w,
+                                  t < 2 ? mine : loaded);
+      built(bases, got.data(), n);
+      for (int i = 0; i < n; ++i)
+        assert(got[i] == (t % 2 ? expected(i) : a[i] * 3 + b[i]));
+    });
+  for (auto &builder : builders)
+    builder.join();
+  assert(!optimize_size);
+}
+
+void test_comprehensions() {
+  assert(lower_comprehensions(expr("sum(i, 0, 3, x * i)"))->to_string() ==
+         "x 0 * x 1 * x 2 * + +");
+  assert(lower_comprehensions(expr("sum(i, 0, n, i)"))->to_string() ==
+         "0 n sum#0 idx#0 idx#0 1 + idx#0 2 + idx#0 3 + next#0 idx#0 end#0");
+  // the outer body loops, so it is emitted once
+  assert(lower_comprehensions(expr("sum(i, 0, n, sum(j, 0, i, j))"))
+             ->to_string() == "0 n sum#0 0 idx#0 sum#1 idx#1 idx#1 1 + idx#1 "
+                              "2 + idx#1 3 + next#1 idx#1 end#1 end#0");
+  assert(eval(optimize(expr("sum(i, 0, 100, i * i) + 1"))->to_string())() ==
+         328351);
+  assert(eval(optimize(expr("prod(i, 5, 2, i) + sum(i, 0 - 3, 3, i)"))
+                  ->to_string())() == -2);
+
+  const int n = 200, size = 8;
+  struct Row {
+    int a[size], b[size], n;
+  };
+  vector<Row> rows(n);
+  for (int r = 0; r < n; ++r) {
+    for (int k = 0; k < size; ++k)
+      rows[r].a[k] = r * 3 - k * 7, rows[r].b[k] = (r + k) % 5;
+    rows[r].n = r % 12; // past the end of a and b now and then
+  }
+  vector<Column> columns = {{"a", sizeof(Row), offsetof(Row, a), size, 1},
+                            {"b", sizeof(Row), offsetof(Row, b), size, 1},
+                            {"n", sizeof(Row), offsetof(Row, n)}};
+  const void *bases[] = {rows.data(), rows.data(), rows.data()};
+  auto at = [](const int *v, int k) { return k >= 0 && k < size ? v[k] : 0; };
+  auto check = [&](const string &text, auto expected) {
+    for (int small = 0; small < 2; ++small) {
+      optimize_size = small;
+      int width;
+      auto kernel = eval_batch(expr(text), columns, &width);
+      vector<int> out(n);
+      kernel(bases, out.data(), n);
+      for (int r = 0; r < n; ++r)
+        assert(out[r] == expected(rows[r]));
+    }
+    optimize_size = false;
+  };
+
+  check("sum(i, 0, 8, a[i] * b[i]) - dot(a, b)", [](const Row &) { return 0; });
+  check("sum(i, 0, n, a[i] * b[i]) * 2 + 1", [&](const Row &row) {
+    int s = 0;
+    for (int i = 0; i < row.n; ++i)
+      s += at(row.a, i) * at(row.b, i);
+    return s * 2 + 1;
+  });
+  check("prod(i, 1, n + 1, i) + prod(i, n, 3, a[i - 1])", [&](const Row &row) {
+    uint32_t f = 1, g = 1;
+    for (int i = 1; i <= row.n; ++i)
+      f *= i;
+    for (int i = row.n; i < 3; ++i)
+      g *= at(row.a, i - 1);
+    return int(f + g);
+  });
+  check("sum(i, 0 - n, n, sum(j, 0, i, b[j]) + i)", [&](const Row &row) {
+    int s = 0;
+    for (int i = -row.n; i < row.n; ++i) {
+      for (int j = 0; j < i; ++j)
+        s += at(row.b, j);
+      s += i;
+    }
+    return s;
+  });
+  check("n ? sum(i, 0, 30, a[i & 7] >> 1) : 5", [&](const Row &row) {
+    int s = 0;
+    for (int i = 0; i < 30; ++i)
+      s += row.a[i & 7] >> 1;
+    return row.n ? s : 5;
+  });
+
+  int width;
+  for (const char *bad : {"sum(3, 0, 4, 1)", "sum(i, 0, 9, a[i])",
+                          "sum(i, 0, n, a)", "3[0]"})
+    try {
+      eval_batch(expr(bad), columns, &width);
+      assert(false);
+    } catch (const runtime_error &) {
+    }
+}
+
+void test_packed() {
+  const int n = 1001;
+  vector<int> time(n), price(n), wide(n), same(n, -42);
+  unsigned seed = 7;
+  for (int i = 0; i < n; ++i) {
+    seed = seed * 1103515245 + 12345;
+    time[i] = 1700000000 + i * 60 + int(seed >> 28);
+    price[i] = 100 + int(seed >> 16) % 16;
+    wide[i] = i % 2 ? INT32_MIN + i : INT32_MAX - i;
+  }
+  auto p = PackedColumn::pack(price);
+  assert(p.bits == 4 && p.reference == 100);
+  auto t = PackedColumn::pack(time, true);
+  assert(t.bits <= 7 && t.words.size() <= (n * 7 + 63) / 64 + 1);
+  for (bool delta : {false, true})
+    for (const auto &values : {time, price, wide, same, vector<int>{}})
+      assert(PackedColumn::pack(values, delta).unpack() == values);
+
+  auto w = PackedColumn::pack(wide), c = PackedColumn::pack(same, true);
+  vector<int> q(n);
+  for (int i = 0; i < n; ++i)
+    q[i] = i % 3;
+  vector<Column> columns = {t.column("t"), p.column("p"),
+                            {"q", sizeof(int), 0}, w.column("w"),
+                            c.column("c")};
+  const void *bases[] = {t.data(), p.data(), q.data(), w.data(), c.data()};
+  int width;
+  auto kernel = eval_batch(expr("(t - 1700000000) * p + q - t + (w ^ c)"),
+                           columns, &width);
+  for (int rows : {n, n / 2, 1}) {
+    vector<int> out(rows);
+    kernel(bases, out.data(), rows);
+    for (int i = 0; i < rows; ++i)
+      assert(out[i] == int(uint32_t(time[i] - 1700000000) * price[i] + q[i] -
+                           time[i] + (wide[i] ^ same[i])));
+  }
+}
+
+int tests() {
+  test_single_digit();
+  test_simple_operations();
+  test_operator_precedence();
+  test_parentheses();
+  test_nested_parentheses();
+  test_complex_expressions();
+  test_unary_operations();
+  test_edge_cases();
+  test_large_numbers();
+  test_no_operators();
+  test_postfix_operators();
+  test_batch_strided();
+  test_arrow();
+  test_jsonl();
+  test_binary_round_trip();
+  test_identifiers();
+  test_parse_many();
+  test_vectors();
+  test_bitwise();
+  test_lookup_tables();
+  test_tabulate();
+  test_host_functions();
+  test_fragments();
+  test_forked();
+  test_memo();
+  test_optimize_size();
+  test_canonicalize();
+  test_grid();
+  test_shapes();
+  test_passes();
+  test_complex();
+  test_traps();
+  test_code_heap();
+  test_profile();
+  test_comprehensions();
+  test_packed();
+
+  std::cout << "All tests passed!" << std::endl;
+  return 0;
+}
+
+// load time of a stored rule set: text through expr() against the
+// binary encoding
+void bench_load() {
+  vector<string> rules;
+  for (int i = 0; i < 100000; ++i)
+    rules.push_back("(a + " + std::to_string(i) + ") * (b - c / " +
+                    std::to_string(i % 97 + 1) + ") + d * e - " +
+                    std::to_string(i * 7));
+  auto seconds = [](auto f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  vector<shared_ptr<S>> parsed;
+  vector<string> rpns;
+  double text = seconds([&] {
+    for (const auto &rule : rules)
+      parsed.push_back(expr(rule));
+  });
+  double text_rpn = seconds([&] {
+    for (const auto &rule : rules)
+      rpns.push_back(expr(rule)->to_string());
+  });
+
+  string bytes = save_exprs(parsed);
+  auto *data = (const uint8_t *)bytes.data();
+  vector<shared_ptr<S>> loaded;
+  vector<string> loaded_rpns;
+  double binary = seconds([&] { loaded = load_exprs(data, bytes.size()); });
+  double binary_rpn =
+      seconds([&] { loaded_rpns = load_rpns(data, bytes.size()); });
+
+  size_t text_bytes = 0;
+  for (const auto &rule : rules)
+    text_bytes += rule.size();
+  cout << "load " << rules.size() << " rules (" << text_bytes
+       << " bytes of text, " << bytes.size() << " bytes binary)" << endl;
+  cout << "  tree: expr() " << text * 1e3 << "ms, load_exprs() "
+       << binary * 1e3 << "ms (" << text / binary << "x)" << endl;
+  cout << "  rpn:  expr()->to_string() " << text_rpn * 1e3
+       << "ms, load_rpns() " << binary_rpn * 1e3 << "ms ("
+       << text_rpn / binary_rpn << "x)" << endl;
+}
+
+// bulk parse throughput: expr() per rule against one shared arena
+void bench_parse_many() {
+  vector<string> rules;
+  for (int i = 0; i < 200000; ++i)
+    rules.push_back("(rate + " + std::to_string(i) + ") * (qty - fee / " +
+                    std::to_string(i % 97 + 1) + ") + tax * base");
+  vector<string_view> views(rules.begin(), rules.end());
+  auto seconds = [](auto f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  vector<shared_ptr<S>> trees;
+  double each = seconds([&] {
+    for (const auto &rule : rules)
+      trees.push_back(expr(rule));
+  });
+  ExprArena arena;
+  double one = seconds([&] { arena = parse_many(views); });
+  unsigned threads = max(1u, thread::hardware_concurrency());
+  double many = seconds([&] { arena = parse_many(views, threads); });
+  cout << "parse " << rules.size() << " rules: expr() " << each * 1e3
+       << "ms, parse_many() " << one * 1e3 << "ms (" << each / one
+       << "x), parse_many() on " << threads << " threads " << many * 1e3
+       << "ms (" << each / many << "x), arena "
+       << arena.nodes.size() * sizeof(ArenaNode) << " bytes" << endl;
+}
+
+// relaxed mode: a costly function of one bounded column as a table
+void bench_tabulate() {
+  const int n = 1 << 20;
+  vector<int> x(n), out(n);
+  for (int i = 0; i < n; ++i)
+    x[i] = i * 2654435761u % 1024;
+  const void *bases[] = {x.data()};
+  vector<Column> columns = {{"x", sizeof(int), 0}};
+  auto e = expr("(x * x * x + 5 * x) / (x * x / 7 + 3) + x * 1000 / (x + 11)");
+  auto seconds = [&](pbatch kernel) {
+    auto start = chrono::steady_clock::now();
+    kernel(bases, out.data(), n);
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  int width;
+  double exact = seconds(eval_batch(e, columns, &width));
+  cout << "tabulate " << n << " rows: exact " << exact * 1e3 << "ms";
+  for (int max_error : {0, 64}) {
+    TabulateOptions options;
+    options.ranges = {{"x", 0, 1023}};
+    options.max_error = max_error;
+    TabulateStats stats;
+    double t = seconds(eval_batch(tabulate(e, options, &stats), columns,
+                                  &width));
+    cout << ", max_error " << max_error << " " << t * 1e3 << "ms ("
+         << exact / t << "x, " << stats.bytes << " byte table, error "
+         << stats.max_error << ")";
+  }
+  cout << endl;
+}
+
+// recompiling a 5000 node formula after editing one term
+void bench_fragments() {
+  vector<int> leaves(2500);
+  for (size_t i = 0; i < leaves.size(); ++i)
+    leaves[i] = i % 89;
+  auto seconds = [](auto f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  auto tree = expr(balanced_formula(leaves, 0, leaves.size()));
+  FragmentCache cache;
+  double whole = seconds([&] { eval(tree->to_string()); });
+  double first = seconds([&] { cache.compile(tree); });
+  leaves[1234] += 1;
+  tree = expr(balanced_formula(leaves, 0, leaves.size()));
+  double edit = seconds([&] { cache.compile(tree); });
+  cout << "recompile " << leaves.size() * 2 - 1 << " nodes: compile_rpn "
+       << whole * 1e3 << "ms, fragments " << first * 1e3 << "ms, after an edit "
+       << edit * 1e3 << "ms (" << whole / edit << "x, "
+       << cache.last().compiled << " of " << cache.size()
+       << " fragments rebuilt)" << endl;
+}
+
+// crash isolation by fork against plain threads over the same shards
+void bench_forked() {
+  const int n = 1 << 22;
+  vector<int> a(n), b(n), out(n);
+  for (int i = 0; i < n; ++i)
+    a[i] = i, b[i] = i % 1000 + 1;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  int width;
+  auto kernel = eval_batch(expr("(a * 7 + b) / b - (a >> 3 & 255)"), columns,
+                           &width);
+  unsigned workers = max(1u, thread::hardware_concurrency());
+
+  auto start = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (unsigned w = 0; w < workers; ++w) {
+    int lo = int64_t(n) * w / workers, hi = int64_t(n) * (w + 1) / workers;
+    threads.emplace_back([&, lo, hi] {
+      const void *shard[] = {a.data() + lo, b.data() + lo};
+      kernel(shard, out.data() + lo, hi - lo);
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  double threaded =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  char path[] = "/tmp/jitxpr_bench_XXXXXX";
+  close(mkstemp(path));
+  ForkStats stats;
+  eval_forked(kernel, columns, bases, n, path, 1, workers, 2, &stats);
+  unlink(path);
+  cout << "batch " << n << " rows on " << workers << " workers: threads "
+       << threaded * 1e3 << "ms, forked " << stats.seconds * 1e3 << "ms ("
+       << threaded / stats.seconds << "x)" << endl;
+}
+
+// repeated inputs through a memo table against calling the kernel
+void bench_memo() {
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  int width;
+  auto kernel = eval_batch(
+      expr("(a * a + 7) / (b + 1) + (a * b + 3) / (a + 1) - a * 5 / (b + 2)"),
+      columns, &width);
+  MemoTable memo(kernel, 2);
+  const int calls = 1 << 20;
+  vector<long> sums;
+  auto seconds = [&](auto f) {
+    long sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < calls; ++i) {
+      int args[] = {i % 500, i % 7};
+      sum += f(args);
+    }
+    sums.push_back(sum);
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+  double direct = seconds([&](const int *args) {
+    const void *bases[] = {args, args + 1};
+    int out;
+    kernel(bases, &out, 1);
+    return out;
+  });
+  double memoized = seconds([&](const int *args) { return memo(args); });
+  assert(sums[0] == sums[1]);
+  auto stats = memo.stats();
+  cout << "memo " << calls << " calls on 3500 inputs: kernel " << direct * 1e3
+       << "ms, memo " << memoized * 1e3 << "ms (" << direct / memoized
+       << "x, hit rate " << double(stats.hits) / calls << ")" << endl;
+}
+
+// a rule set generated for bytes against one generated for speed
+void bench_code_size() {
+  const int rules = 1000, rows = 64, rounds = 20;
+  vector<int> a(rows), b(rows);
+  for (int i = 0; i < rows; ++i)
+    a[i] = i * 37 % 1000, b[i] = i % 13 + 1;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  vector<int> out(rows);
+  int width;
+
+  for (int small = 0; small < 2; ++small) {
+    optimize_size = small;
+    size_t before = code_bytes;
+    vector<pbatch> kernels;
+    for (int r = 0; r < rules; ++r) {
+      string edges, values = std::to_string(r % 7);
+      for (int k = 0; k < 6; ++k) {
+        edges += (k ? ", " : "") + std::to_string(k * 150 + r % 50);
+        values += ", " + std::to_string(k * r % 31);
+      }
+      kernels.push_back(eval_batch(
+          expr("piecewise(a, [" + edges + "], [" + values + "]) * b + a / " +
+               std::to_string(r % 9 + 1) + " - (b << " +
+               std::to_string(r % 5) + ")"),
+          columns, &width));
+    }
+    size_t bytes = code_bytes - before;
+    long sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int k = 0; k < rounds; ++k)
+      for (auto kernel : kernels) {
+        kernel(bases, out.data(), rows);
+        sum += out[k % rows];
+      }
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << (small ? "size" : "speed") << " mode: " << rules << " rules, "
+         << bytes << " code bytes, "
+         << double(rules) * rows * rounds / seconds / 1e6
+         << "M rule rows/s (checksum " << sum << ")" << endl;
+  }
+  optimize_size = false;
+}
+
+// coordinates generated in the kernel against materialised input columns
+void bench_grid() {
+  const int n = 1024;
+  vector<GridAxis> axes = {{"x", -1000, 1000, n}, {"y", 0, 5000, n}};
+  string f = "(x * x + y * y) >> 4 ^ x * y";
+  auto start = chrono::steady_clock::now();
+  auto grid = eval_grid(expr(f), axes);
+  double generated =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  start = chrono::steady_clock::now();
+  vector<int> x(n * n), y(n * n), out(n * n);
+  for (int j = 0; j < n; ++j)
+    for (int i = 0; i < n; ++i) {
+      x[j * n + i] = -1000 + 2000 * i / (n - 1);
+      y[j * n + i] = 5000 * j / (n - 1);
+    }
+  vector<Column> columns = {{"x", sizeof(int), 0}, {"y", sizeof(int), 0}};
+  int width;
+  auto kernel = eval_batch(expr(f), columns, &width);
+  unsigned threads = max(1u, thread::hardware_concurrency());
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+    workers.emplace_back([&, t] {
+      int lo = int64_t(n) * n * t / threads;
+      int hi = int64_t(n) * n * (t + 1) / threads;
+      const void *shard[] = {x.data() + lo, y.data() + lo};
+      kernel(shard, out.data() + lo, hi - lo);
+    });
+  for (auto &w : workers)
+    w.join();
+  double materialised =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  assert(out == grid);
+  cout << "grid " << n << "x" << n << ": generated " << generated * 1e3
+       << "ms, materialised inputs " << materialised * 1e3 << "ms ("
+       << materialised / generated << "x)" << endl;
+}
+
+// hit rate of the prebuilt shapes on a generated rule corpus, and the
+// time to a runnable kernel with and without them
+void bench_shapes() {
+  const int rules = 500;
+  vector<string> corpus;
+  unsigned seed = 12345;
+  auto next = [&seed](unsigned n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+  };
+  const char *vars[] = {"a", "b", "c", "d"}, *ops[] = {"+", "-", "*", "/"};
+  for (int r = 0; r < rules; ++r) {
+    auto leaf = [&] {
+      return next(3) ? string(vars[next(4)]) : std::to_string(next(100) + 1);
+    };
+    string f = leaf();
+    for (unsigned k = next(4); k > 0; --k) {
+      string op = next(10) ? ops[next(4)] : "&";
+      f = next(2) ? "(" + f + ") " + op + " " + leaf()
+                  : leaf() + " " + op + " (" + f + ")";
+    }
+    corpus.push_back(f);
+  }
+  vector<Column> columns;
+  for (const char *v : vars)
+    columns.push_back({v, sizeof(int), 0});
+
+  auto seconds = [](auto f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+  ShapeStats stats;
+  double shaped = seconds([&] {
+    for (const auto &f : corpus)
+      batch_kernel(expr(f), columns, &stats);
+  });
+  int width;
+  double compiled = seconds([&] {
+    for (const auto &f : corpus)
+      eval_batch(expr(f), columns, &width);
+  });
+  cout << "shapes on " << rules << " rules: hit rate "
+       << double(stats.hits) / rules << ", kernels in " << shaped * 1e3
+       << "ms against " << compiled * 1e3 << "ms all compiled" << endl;
+}
+
+// compile time per level, and what each pass spent and changed
+void bench_passes() {
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  vector<string> rules;
+  for (int r = 0; r < 200; ++r) {
+    string k = std::to_string(r % 17 + 1);
+    rules.push_back("(a * " + k + " + b) * (b + " + k + " * a) + (a & 255) * 1 -"
+                    " (b - b) + " + k + " * 3 + ((a & 255) >> 8) * b");
+  }
+  int width;
+  for (int level = 0; level <= 3; ++level) {
+    passes().reset_stats();
+    auto start = chrono::steady_clock::now();
+    for (const auto &rule : rules)
+      eval_batch(expr(rule), columns, &width, level);
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "-O" << level << ": " << rules.size() << " rules in "
+         << seconds * 1e3 << "ms";
+    for (const auto &pass : passes().stats())
+      if (pass.runs)
+        cout << ", " << pass.name << " " << pass.seconds * 1e3 << "ms/"
+             << pass.changes;
+    cout << endl;
+  }
+}
+
+// calls spread over a heap fragmented by compile and evict cycles, then
+// over the same functions compacted
+void bench_code_heap() {
+  CodeHeap heap;
+  vector<int> live;
+  unsigned seed = 99;
+  const int cycles = 4, batch = 40;
+  for (int cycle = 0; cycle < cycles; ++cycle) {
+    for (int k = 0; k < batch; ++k)
+      live.push_back(heap.add(
+          expr("(" + std::to_string(cycle * batch + k) + " * 3 + 1) / 2")
+              ->to_string()));
+    for (size_t i = 0; i < live.size();) {
+      seed = seed * 1103515245 + 12345;
+      if ((seed >> 16) % 3 == 0)
+        heap.evict(live[i]), live[i] = live.back(), live.pop_back();
+      else
+        ++i;
+    }
+  }
+  auto report = [&](const char *when) {
+    auto s = heap.stats();
+    long sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int round = 0; round < 500; ++round)
+      for (int id : live)
+        sum += heap.call(id);
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "code heap " << when << ": " << s.functions << " functions, "
+         << s.regions << " regions, " << s.live << "/" << s.used
+         << " bytes live (fragmentation " << s.fragmentation << "), rss "
+         << s.rss / 1024 << "KB, " << 500 * live.size() / seconds / 1e6
+         << "M calls/s (" << sum << ")" << endl;
+  };
+  report("before");
+  heap.compact();
+  report("after");
+}
+
+// a rule with a lopsided '?' and masks its inputs make redundant, built
+// plainly and from a profile of a training run
+void bench_pgo() {
+  const int n = 1 << 14, rounds = 20;
+  vector<int> a(n), b(n), out(n);
+  for (int i = 0; i < n; ++i)
+    a[i] = i % 16 ? 0 : i % 200 + 1, b[i] = i * 7 % 1000;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", sizeof(int), 0}, {"b", sizeof(int), 0}};
+  auto e = expr("a ? (b & 1023) / a : ((b & 4095) >> 2) * 3 + (a | b) & 65535");
+  int width;
+  Profile profile;
+  eval_batch_profiling(e, columns, &width, profile)(bases, out.data(), n);
+  auto seconds = [&](auto kernel) {
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+      kernel(bases, out.data(), n);
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+  double plain = seconds(eval_batch(e, columns, &width));
+  double pgo = seconds(eval_batch_pgo(e, columns, &width, profile));
+  cout << "pgo on " << rounds * n << " rows: " << plain * 1e3 << "ms plain, "
+       << pgo * 1e3 << "ms from the profile (" << plain / pgo << "x)" << endl;
+}
+
+// a 64-term dot product as a loop of LOOP_LANES accumulators, as a loop of
+// one, and unrolled by dot()
+void bench_comprehensions() {
+  const int n = 1 << 10, size = 64, rounds = 5;
+  vector<int> a(n * size), b(n * size), out(n);
+  for (int i = 0; i < n * size; ++i)
+    a[i] = i % 101, b[i] = i % 7 - 3;
+  const void *bases[] = {a.data(), b.data()};
+  vector<Column> columns = {{"a", size * sizeof(int), 0, size, 1},
+                            {"b", size * sizeof(int), 0, size, 1}};
+  auto seconds = [&](const char *text, bool small) {
+    optimize_size = small;
+    int width;
+    auto kernel = eval_batch(expr(text), columns, &width);
+    optimize_size = false;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+      kernel(bases, out.data(), n);
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+  const char *loop = "sum(i, 0, 64, a[i] * b[i])";
+  double lanes = seconds(loop, false), one = seconds(loop, true),
+         unrolled = seconds("dot(a, b)", false);
+  cout << "sum() over " << rounds * n << " rows of 64: " << lanes * 1e3
+       << "ms with " << LOOP_LANES << " accumulators, " << one * 1e3
+       << "ms with one, " << unrolled * 1e3 << "ms unrolled" << endl;
+}
+
+// packed columns read in place against unpacking them first
+void bench_packed() {
+  const int n = 1 << 16, rounds = 5;
+  vector<int> time(n), price(n), out(n);
+  for (int i = 0; i < n; ++i)
+    time[i] = 1700000000 + i * 60 + i % 13, price[i] = 100 + i * 7 % 256;
+  auto t = PackedColumn::pack(time, true), p = PackedColumn::pack(price);
+  auto e = expr("(t - 1700000000) / 60 * p");
+  int width;
+  auto fused = eval_batch(e, {t.column("t"), p.column("p")}, &width);
+  auto plain = eval_batch(
+      e, {{"t", sizeof(int), 0}, {"p", sizeof(int), 0}}, &width);
+  auto seconds = [&](auto run) {
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+      run();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+  };
+  double in_place = seconds([&] {
+    const void *bases[] = {t.data(), p.data()};
+    fused(bases, out.data(), n);
+  });
+  double unpacked = seconds([&] {
+    vector<int> tv = t.unpack(), pv = p.unpack();
+    const void *bases[] = {tv.data(), pv.data()};
+    plain(bases, out.data(), n);
+  });
+  size_t bytes = (t.words.size() + p.words.size()) * sizeof(uint64_t);
+  cout << "packed " << rounds * n << " rows (" << t.bits << "+" << p.bits
+       << " bits, " << bytes * 100 / (2 * n * sizeof(int)) << "% of plain): "
+       << in_place * 1e3 << "ms in place, " << unpacked * 1e3
+       << "ms unpacked first" << endl;
+}
+
+int bench() {
+  bench_load();
+  bench_parse_many();
+  bench_tabulate();
+  bench_fragments();
+  bench_forked();
+  bench_memo();
+  bench_code_size();
+  bench_grid();
+  bench_shapes();
+  bench_passes();
+  bench_code_heap();
+  bench_pgo();
+  bench_comprehensions();
+  bench_packed();
+  return 0;
+}
+int main(int argc, char **argv) {
   /*tests();*/
   jit_node_t *c_expr;
   string line;
   init_jit(argv[0]);
+  for (; argc > 1 && argv[1][0] == '-' && argv[1][1] == 'O'; ++argv, --argc)
+    if (string(argv[1]) == "-Os")
+      optimize_size = true;
+    else if (strlen(argv[1]) == 3 && argv[1][2] >= '0' && argv[1][2] <= '3')
+      opt_level = argv[1][2] - '0';
+    else {
+      cerr << "unknown optimization level " << argv[1] << endl;
+      return 1;
+    }
+  if (argc > 1 && string(argv[1]) == "--test")
+    return tests();
+  if (argc > 1 && string(argv[1]) == "--bench")
+    return bench();
+  if (argc > 3 && string(argv[1]) == "--jsonl") {
+    JsonlStats stats;
+    auto values =
+        eval_jsonl(argv[2], optimize(expr(argv[3]))->to_string(), &stats);
+    for (int v : values)
+      cout << v << '\n';
+    cerr << values.size() << " records, " << stats.bytes << " bytes in "
+         << stats.seconds << "s (" << stats.bytes / stats.seconds / 1e9
+         << " GB/s)" << endl;
+    return 0;
+  }
   do {
     cout << "<rpn> ";
     getline(cin, line);
-    auto result = expr(line);
+    auto result = optimize(expr(line));
     auto function = eval(result->to_string());
     cout << result->to_string() << " -> " << function() << endl;
   } while (line != "quit");